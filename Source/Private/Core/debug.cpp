@@ -21,7 +21,8 @@ DColor DColor::White    {FColor::White,  COLOR_WHITE};
 }*/
 
 void Debug::printOnScreen(const FString &msg, const DColor &color, float duration, uint64 key){
-    if (GEngine){
+    //on screen messages are game thread only, logs from worker threads still reach the log
+    if (GEngine && IsInGameThread()){
         GEngine->AddOnScreenDebugMessage(key,duration,color.ScreenColor,msg );
     }
 }
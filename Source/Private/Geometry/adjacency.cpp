@@ -0,0 +1,74 @@
+#include "adjacency.h"
+#include "core.h"
+#include "Algo/Sort.h"
+
+
+void mesh_adjacency::build_vertex_triangles( const int* indices, int32 index_count, int32 vert_count )
+{
+    //counting pass, then a prefix sum turns counts into offsets, then a filling pass
+    m_offsets.Reset( vert_count + 1 );
+    m_offsets.AddZeroed( vert_count + 1 );
+    for( int32 i = 0; i < index_count; ++i )
+    {
+        ++m_offsets[indices[i] + 1];
+    }
+    for( int32 v = 0; v < vert_count; ++v )
+    {
+        m_offsets[v + 1] += m_offsets[v];
+    }
+
+    TArray<int32> cursor( m_offsets.GetData(), vert_count );
+    m_items.SetNumUninitialized( index_count );
+    for( int32 i = 0; i < index_count; ++i )
+    {
+        m_items[cursor[indices[i]]++] = i / 3;
+    }
+}
+
+void mesh_adjacency::build_vertex_vertices( const int* indices, int32 index_count, int32 vert_count )
+{
+    //every triangle edge is listed from both ends, which names each neighbour twice on a closed mesh
+    m_offsets.Reset( vert_count + 1 );
+    m_offsets.AddZeroed( vert_count + 1 );
+    for( int32 i = 0; i < index_count; ++i )
+    {
+        m_offsets[indices[i] + 1] += 2;
+    }
+    for( int32 v = 0; v < vert_count; ++v )
+    {
+        m_offsets[v + 1] += m_offsets[v];
+    }
+
+    TArray<int32> cursor( m_offsets.GetData(), vert_count );
+    m_items.SetNumUninitialized( 2 * index_count );
+    for( int32 i = 0; i < index_count; i += 3 )
+    {
+        for( int32 edge = 0; edge < 3; ++edge )
+        {
+            int32 a = indices[i + edge];
+            int32 b = indices[i + (edge + 1) % 3];
+            m_items[cursor[a]++] = b;
+            m_items[cursor[b]++] = a;
+        }
+    }
+
+    //sort each list and squeeze the duplicates out, lists only ever move toward the front
+    int32 write = 0;
+    int32 start = m_offsets[0];
+    for( int32 v = 0; v < vert_count; ++v )
+    {
+        int32 end = m_offsets[v + 1];
+        Algo::Sort( TArrayView<int32>( m_items.GetData() + start, end - start ) );
+        m_offsets[v] = write;
+        for( int32 k = start; k < end; ++k )
+        {
+            if( write == m_offsets[v] || m_items[write - 1] != m_items[k] )
+            {
+                m_items[write++] = m_items[k];
+            }
+        }
+        start = end;
+    }
+    m_offsets[vert_count] = write;
+    m_items.SetNum( write );
+}
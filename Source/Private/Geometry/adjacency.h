@@ -0,0 +1,26 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+* Compressed adjacency lists for an indexed triangle mesh.
+* The items of element e are items[offsets[e]] .. items[offsets[e+1] - 1], so the whole table is two flat arrays.
+*/
+class mesh_adjacency
+{
+private:
+    TArray<int32> m_offsets;
+    TArray<int32> m_items;
+
+public:
+    // triangles touching each vertex
+    void build_vertex_triangles( const int* indices, int32 index_count, int32 vert_count );
+    // vertices sharing an edge with each vertex, sorted
+    void build_vertex_vertices( const int* indices, int32 index_count, int32 vert_count );
+
+    int32 num_elements() const { return m_offsets.Num() > 0 ? m_offsets.Num() - 1 : 0; }
+    int32 num( int32 element ) const { return m_offsets[element + 1] - m_offsets[element]; }
+    const int32* get( int32 element ) const { return m_items.GetData() + m_offsets[element]; }
+};
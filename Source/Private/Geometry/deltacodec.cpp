@@ -0,0 +1,132 @@
+#include "deltacodec.h"
+#include "core.h"
+
+
+static int32 varint_size( uint32 value )
+{
+    int32 size = 1;
+    for( ; value >= 0x80; value >>= 7 )
+    {
+        ++size;
+    }
+    return size;
+}
+
+static void put_varint( TArray<uint8> &packet, uint32 value )
+{
+    for( ; value >= 0x80; value >>= 7 )
+    {
+        packet.Add( (uint8)(value | 0x80) );
+    }
+    packet.Add( (uint8)value );
+}
+
+static bool get_varint( const TArray<uint8> &packet, int32 &cursor, uint32 &value )
+{
+    value = 0;
+    for( int32 shift = 0; shift < 35; shift += 7 )
+    {
+        if( cursor >= packet.Num() )
+        {
+            return false;
+        }
+        uint8 byte = packet[cursor++];
+        value |= (uint32)(byte & 0x7F) << shift;
+        if( !(byte & 0x80) )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32 zigzag( int32 value )
+{
+    return ((uint32)value << 1) ^ (uint32)(value >> 31);
+}
+
+static int32 unzigzag( uint32 value )
+{
+    return (int32)(value >> 1) ^ -(int32)(value & 1);
+}
+
+int32 deformation_codec::encode( const int32* vertices, const int16* offsets, int32 count, int32 budget, TArray<uint8> &packet )
+{
+    int32 written = 0;
+    uint32 previous_end = 0;
+    while( written < count )
+    {
+        int32 run_end = written + 1;
+        while( run_end < count && vertices[run_end] == vertices[run_end - 1] + 1 )
+        {
+            ++run_end;
+        }
+        const uint32 gap = vertices[written] - previous_end;
+        int32 room = budget - packet.Num() - varint_size( gap ) - varint_size( run_end - written );
+        //find how much of the run fits, a run cut short ends the packet
+        int32 fitted = 0;
+        int32 previous = 0;
+        for( int32 k = written; k < run_end; ++k )
+        {
+            room -= varint_size( zigzag( offsets[k] - previous ) );
+            if( room < 0 )
+            {
+                break;
+            }
+            previous = offsets[k];
+            ++fitted;
+        }
+        if( fitted == 0 )
+        {
+            break;
+        }
+
+        put_varint( packet, gap );
+        put_varint( packet, fitted );
+        previous = 0;
+        for( int32 k = written; k < written + fitted; ++k )
+        {
+            put_varint( packet, zigzag( offsets[k] - previous ) );
+            previous = offsets[k];
+        }
+        previous_end = vertices[written] + fitted;
+        written += fitted;
+        if( written < run_end )
+        {
+            break;
+        }
+    }
+    return written;
+}
+
+bool deformation_codec::decode( const TArray<uint8> &packet, TArray<int32> &vertices, TArray<int16> &offsets )
+{
+    int32 cursor = 0;
+    uint32 previous_end = 0;
+    while( cursor < packet.Num() )
+    {
+        uint32 gap;
+        uint32 length;
+        if( !get_varint( packet, cursor, gap ) || !get_varint( packet, cursor, length ) )
+        {
+            logWarning(Replication,"Malformed deformation packet, run header cut short.");
+            return false;
+        }
+        int32 previous = 0;
+        uint32 vertex = previous_end + gap;
+        for( uint32 k = 0; k < length; ++k )
+        {
+            uint32 delta;
+            if( !get_varint( packet, cursor, delta ) )
+            {
+                logWarning(Replication,"Malformed deformation packet, run of %u vertices cut short at %u.",length,k);
+                return false;
+            }
+            previous += unzigzag( delta );
+            vertices.Add( vertex + k );
+            offsets.Add( (int16)previous );
+        }
+        previous_end = vertex + length;
+    }
+    return true;
+}
@@ -0,0 +1,23 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+* Packs sparse per-vertex radial offsets for the network.
+* A packet is a list of runs of consecutive vertex indices:
+*   varint  gap from the end of the previous run to the first vertex of this one
+*   varint  number of vertices in the run
+*   varint  zigzag difference of each offset from the one before it (the first one from 0)
+* Offsets are absolute (from the terrain under the vertex, not from the last packet), so applying a packet twice or
+* out of order with its neighbours is harmless.
+*/
+class deformation_codec
+{
+public:
+    // `vertices` sorted ascending. Writes as much as fits in `budget` bytes, returns how many vertices made it in
+    static int32 encode( const int32* vertices, const int16* offsets, int32 count, int32 budget, TArray<uint8> &packet );
+    // false if the packet is malformed, whatever was decoded before the error is kept
+    static bool decode( const TArray<uint8> &packet, TArray<int32> &vertices, TArray<int16> &offsets );
+};
@@ -0,0 +1,349 @@
+#include "displacement.h"
+#include "spherebatch.h"
+#include "core.h"
+#include "Async/ParallelFor.h"
+#include "Math/RandomStream.h"
+#include "Math/VectorRegister.h"
+
+
+//vertices per worker task, a multiple of the 4 lanes of a vector register
+static const int32 displace_batch = 1024;
+
+heightmap_source::heightmap_source( const TArray<float> &texels, int32 width, int32 height )
+    : m_texels( texels ), m_width( width ), m_height( height )
+{
+}
+
+void heightmap_source::sample( const float* x, const float* y, const float* z, float* heights, int32 count ) const
+{
+    for( int32 i = 0; i < count; ++i )
+    {
+        float u = FMath::Atan2( x[i], z[i] ) / (2.f * PI);
+        u = u < 0.f ? u + 1.f : u;
+        float fx = u * m_width - 0.5f;
+        float fy = FMath::Acos( FMath::Clamp( y[i], -1.f, 1.f ) ) / PI * m_height - 0.5f;
+        int32 x0 = FMath::FloorToInt( fx );
+        int32 y0 = FMath::FloorToInt( fy );
+        float tx = fx - x0;
+        float ty = fy - y0;
+        int32 x1 = ((x0 + 1) % m_width + m_width) % m_width;
+        x0 = (x0 % m_width + m_width) % m_width;
+        int32 y1 = FMath::Clamp( y0 + 1, 0, m_height - 1 );
+        y0 = FMath::Clamp( y0, 0, m_height - 1 );
+        const float* row0 = m_texels.GetData() + y0 * m_width;
+        const float* row1 = m_texels.GetData() + y1 * m_width;
+        float top = FMath::Lerp( row0[x0], row0[x1], tx );
+        float bottom = FMath::Lerp( row1[x0], row1[x1], tx );
+        heights[i] = FMath::Lerp( top, bottom, ty );
+    }
+}
+
+fbm_source::fbm_source( int32 seed, int32 octaves, float frequency, float lacunarity, float gain )
+    : m_octaves( FMath::Max( 1, octaves ) ), m_frequency( frequency ), m_lacunarity( lacunarity ), m_gain( gain )
+{
+    FRandomStream stream( seed );
+    for( int32 i = 0; i < 256; ++i )
+    {
+        m_permutation[i] = (uint8)i;
+    }
+    for( int32 i = 255; i > 0; --i )
+    {
+        Swap( m_permutation[i], m_permutation[stream.RandRange( 0, i )] );
+    }
+    for( int32 i = 0; i < 256; ++i )
+    {
+        m_permutation[256 + i] = m_permutation[i];
+    }
+}
+
+//improved Perlin noise's 16 gradients, written out as vectors so they can be dotted four lanes at a time
+static const float gradients[16][3] = {
+    { 1.f, 1.f, 0.f }, { -1.f, 1.f, 0.f }, { 1.f, -1.f, 0.f }, { -1.f, -1.f, 0.f },
+    { 1.f, 0.f, 1.f }, { -1.f, 0.f, 1.f }, { 1.f, 0.f, -1.f }, { -1.f, 0.f, -1.f },
+    { 0.f, 1.f, 1.f }, { 0.f, -1.f, 1.f }, { 0.f, 1.f, -1.f }, { 0.f, -1.f, -1.f },
+    { 1.f, 1.f, 0.f }, { 0.f, -1.f, 1.f }, { -1.f, 1.f, 0.f }, { 0.f, -1.f, -1.f }
+};
+
+static VectorRegister fade( const VectorRegister &t )
+{
+    //t^3 (t (6t - 15) + 10)
+    VectorRegister inner = VectorMultiplyAdd( t, VectorSetFloat1( 6.f ), VectorSetFloat1( -15.f ) );
+    inner = VectorMultiplyAdd( t, inner, VectorSetFloat1( 10.f ) );
+    return VectorMultiply( VectorMultiply( VectorMultiply( t, t ), t ), inner );
+}
+
+static VectorRegister lerp( const VectorRegister &a, const VectorRegister &b, const VectorRegister &t )
+{
+    return VectorMultiplyAdd( VectorSubtract( b, a ), t, a );
+}
+
+VectorRegister fbm_source::noise( const VectorRegister &x, const VectorRegister &y, const VectorRegister &z ) const
+{
+    alignas(16) float position[3][4];
+    VectorStoreAligned( x, position[0] );
+    VectorStoreAligned( y, position[1] );
+    VectorStoreAligned( z, position[2] );
+
+    //the hashing is table lookups, which have no vector form without gathers, so each lane picks its corners'
+    //gradients here and everything after is done four lanes at a time
+    alignas(16) float cell[3][4];
+    alignas(16) float corner_gradient[8][3][4]; //corner (x bit, y bit, z bit), axis, lane
+    const uint8* p = m_permutation;
+    for( int32 lane = 0; lane < 4; ++lane )
+    {
+        for( int32 axis = 0; axis < 3; ++axis )
+        {
+            cell[axis][lane] = FMath::FloorToFloat( position[axis][lane] );
+        }
+        const int32 X = (int32)cell[0][lane] & 255;
+        const int32 Y = (int32)cell[1][lane] & 255;
+        const int32 Z = (int32)cell[2][lane] & 255;
+        const int32 A = p[X] + Y;
+        const int32 AA = p[A] + Z;
+        const int32 AB = p[A + 1] + Z;
+        const int32 B = p[X + 1] + Y;
+        const int32 BA = p[B] + Z;
+        const int32 BB = p[B + 1] + Z;
+        const uint8 hashes[8] = { p[AA], p[BA], p[AB], p[BB], p[AA + 1], p[BA + 1], p[AB + 1], p[BB + 1] };
+        for( int32 corner = 0; corner < 8; ++corner )
+        {
+            const float* g = gradients[hashes[corner] & 15];
+            corner_gradient[corner][0][lane] = g[0];
+            corner_gradient[corner][1][lane] = g[1];
+            corner_gradient[corner][2][lane] = g[2];
+        }
+    }
+
+    const VectorRegister one = VectorSetFloat1( 1.f );
+    const VectorRegister fx = VectorSubtract( x, VectorLoadAligned( cell[0] ) );
+    const VectorRegister fy = VectorSubtract( y, VectorLoadAligned( cell[1] ) );
+    const VectorRegister fz = VectorSubtract( z, VectorLoadAligned( cell[2] ) );
+    VectorRegister dots[8];
+    for( int32 corner = 0; corner < 8; ++corner )
+    {
+        const VectorRegister dx = (corner & 1) ? VectorSubtract( fx, one ) : fx;
+        const VectorRegister dy = (corner & 2) ? VectorSubtract( fy, one ) : fy;
+        const VectorRegister dz = (corner & 4) ? VectorSubtract( fz, one ) : fz;
+        dots[corner] = VectorMultiplyAdd( VectorLoadAligned( corner_gradient[corner][0] ), dx,
+                       VectorMultiplyAdd( VectorLoadAligned( corner_gradient[corner][1] ), dy,
+                       VectorMultiply( VectorLoadAligned( corner_gradient[corner][2] ), dz ) ) );
+    }
+
+    const VectorRegister u = fade( fx );
+    const VectorRegister v = fade( fy );
+    const VectorRegister w = fade( fz );
+    return lerp(
+        lerp( lerp( dots[0], dots[1], u ), lerp( dots[2], dots[3], u ), v ),
+        lerp( lerp( dots[4], dots[5], u ), lerp( dots[6], dots[7], u ), v ),
+        w );
+}
+
+void fbm_source::sample( const float* x, const float* y, const float* z, float* heights, int32 count ) const
+{
+    float total = 0.f;
+    float amplitude = 1.f;
+    for( int32 octave = 0; octave < m_octaves; ++octave )
+    {
+        total += amplitude;
+        amplitude *= m_gain;
+    }
+    const VectorRegister normalize = VectorSetFloat1( 1.f / total );
+
+    for( int32 i = 0; i < count; i += 4 )
+    {
+        //a short last group is padded through a local copy, callers' arrays need not be padded
+        const int32 lanes = FMath::Min( 4, count - i );
+        alignas(16) float lane[4][4] = {};
+        for( int32 k = 0; k < lanes; ++k )
+        {
+            lane[0][k] = x[i + k];
+            lane[1][k] = y[i + k];
+            lane[2][k] = z[i + k];
+        }
+        const VectorRegister X = VectorLoadAligned( lane[0] );
+        const VectorRegister Y = VectorLoadAligned( lane[1] );
+        const VectorRegister Z = VectorLoadAligned( lane[2] );
+
+        VectorRegister sum = VectorZero();
+        float octave_amplitude = 1.f;
+        float frequency = m_frequency;
+        for( int32 octave = 0; octave < m_octaves; ++octave )
+        {
+            const VectorRegister F = VectorSetFloat1( frequency );
+            VectorRegister n = noise( VectorMultiply( X, F ), VectorMultiply( Y, F ), VectorMultiply( Z, F ) );
+            sum = VectorMultiplyAdd( n, VectorSetFloat1( octave_amplitude ), sum );
+            octave_amplitude *= m_gain;
+            frequency *= m_lacunarity;
+        }
+        VectorStoreAligned( VectorMultiply( sum, normalize ), lane[3] );
+        for( int32 k = 0; k < lanes; ++k )
+        {
+            heights[i + k] = lane[3][k];
+        }
+    }
+}
+
+displacement_stats displacement::displace( const height_source &source, float radius, float scale, const TArray<int> &triangles, TArray<FVector> &vertices, TArray<FVector> &normals )
+{
+    displacement_stats stats;
+    stats.vertices = vertices.Num();
+
+    double start = FPlatformTime::Seconds();
+    FVector* out = vertices.GetData();
+    const int32 total = vertices.Num();
+    ParallelFor( FMath::DivideAndRoundUp( total, displace_batch ), [&source, out, total, radius, scale]( int32 batch ){
+        const int32 first = batch * displace_batch;
+        const int32 count = FMath::Min( displace_batch, total - first );
+        const int32 padded = Align( count, 4 );
+        alignas(16) float x[displace_batch];
+        alignas(16) float y[displace_batch];
+        alignas(16) float z[displace_batch];
+        alignas(16) float h[displace_batch];
+        for( int32 k = 0; k < count; ++k )
+        {
+            x[k] = out[first + k].X;
+            y[k] = out[first + k].Y;
+            z[k] = out[first + k].Z;
+        }
+        //the lanes past the end only need to survive a normalize
+        for( int32 k = count; k < padded; ++k )
+        {
+            x[k] = 1.f;
+            y[k] = z[k] = h[k] = 0.f;
+        }
+
+        for( int32 k = 0; k < padded; k += 4 )
+        {
+            VectorRegister X = VectorLoadAligned( x + k );
+            VectorRegister Y = VectorLoadAligned( y + k );
+            VectorRegister Z = VectorLoadAligned( z + k );
+            VectorRegister Inverse = VectorReciprocalSqrtAccurate( VectorMultiplyAdd( X, X, VectorMultiplyAdd( Y, Y, VectorMultiply( Z, Z ) ) ) );
+            VectorStoreAligned( VectorMultiply( X, Inverse ), x + k );
+            VectorStoreAligned( VectorMultiply( Y, Inverse ), y + k );
+            VectorStoreAligned( VectorMultiply( Z, Inverse ), z + k );
+        }
+
+        source.sample( x, y, z, h, count );
+
+        const VectorRegister Radius = VectorSetFloat1( radius );
+        const VectorRegister Scale = VectorSetFloat1( scale );
+        for( int32 k = 0; k < padded; k += 4 )
+        {
+            VectorRegister Length = VectorMultiplyAdd( VectorLoadAligned( h + k ), Scale, Radius );
+            VectorStoreAligned( VectorMultiply( VectorLoadAligned( x + k ), Length ), x + k );
+            VectorStoreAligned( VectorMultiply( VectorLoadAligned( y + k ), Length ), y + k );
+            VectorStoreAligned( VectorMultiply( VectorLoadAligned( z + k ), Length ), z + k );
+        }
+        for( int32 k = 0; k < count; ++k )
+        {
+            out[first + k] = FVector( x[k], y[k], z[k] );
+        }
+    } );
+    stats.displace_seconds = FPlatformTime::Seconds() - start;
+
+    start = FPlatformTime::Seconds();
+    smooth_normals( vertices, triangles, normals );
+    stats.normal_seconds = FPlatformTime::Seconds() - start;
+
+    const double seconds = stats.displace_seconds + stats.normal_seconds;
+    stats.vertices_per_second = seconds > 0.0 ? total / seconds : 0.0;
+    logInfoC(Geometry,DColor::Cyan,false,"Displaced vertices {vertices: %d, displacement: %.3f s, normals: %.3f s, vertices/s: %.0f}",total,stats.displace_seconds,stats.normal_seconds,stats.vertices_per_second);
+    return stats;
+}
+
+void displacement::update_adjacency( const TArray<FVector> &vertices, const TArray<int> &triangles )
+{
+    //topology rarely changes, the adjacency is kept until it does
+    if( m_vert_count != vertices.Num() || m_index_count != triangles.Num() )
+    {
+        m_vertex_triangles.build_vertex_triangles( triangles.GetData(), triangles.Num(), vertices.Num() );
+        m_vert_count = vertices.Num();
+        m_index_count = triangles.Num();
+    }
+}
+
+FVector displacement::vertex_normal( int32 vertex, const TArray<FVector> &vertices, const TArray<int> &triangles ) const
+{
+    //unnormalized cross products weigh each triangle by its area. icosphere triangles wind clockwise seen from outside
+    FVector sum = FVector::ZeroVector;
+    const int32* touching = m_vertex_triangles.get( vertex );
+    for( int32 t = 0; t < m_vertex_triangles.num( vertex ); ++t )
+    {
+        const int* tri = triangles.GetData() + 3 * touching[t];
+        const FVector &a = vertices[tri[0]];
+        sum += FVector::CrossProduct( vertices[tri[2]] - a, vertices[tri[1]] - a );
+    }
+    return sum.GetSafeNormal();
+}
+
+void displacement::smooth_normals( const TArray<FVector> &vertices, const TArray<int> &triangles, TArray<FVector> &normals )
+{
+    update_adjacency( vertices, triangles );
+    normals.SetNumUninitialized( vertices.Num() );
+
+    const int32 total = vertices.Num();
+    ParallelFor( FMath::DivideAndRoundUp( total, displace_batch ), [this, &vertices, &triangles, &normals, total]( int32 batch ){
+        const int32 end = FMath::Min( total, (batch + 1) * displace_batch );
+        for( int32 v = batch * displace_batch; v < end; ++v )
+        {
+            normals[v] = vertex_normal( v, vertices, triangles );
+        }
+    } );
+}
+
+void displacement::smooth_normals( const TArray<FVector> &vertices, const TArray<int> &triangles, TArray<int32> &changed, TArray<FVector> &normals )
+{
+    update_adjacency( vertices, triangles );
+    if( normals.Num() != vertices.Num() )
+    {
+        smooth_normals( vertices, triangles, normals );
+        return;
+    }
+
+    //a vertex's normal depends on the triangles around it, so moving it affects every vertex of those triangles
+    const int32 moved = changed.Num();
+    for( int32 i = 0; i < moved; ++i )
+    {
+        const int32 v = changed[i];
+        if( v < 0 || v >= vertices.Num() )
+        {
+            continue;
+        }
+        const int32* touching = m_vertex_triangles.get( v );
+        for( int32 t = 0; t < m_vertex_triangles.num( v ); ++t )
+        {
+            const int* tri = triangles.GetData() + 3 * touching[t];
+            changed.Append( tri, 3 );
+        }
+    }
+    changed.Sort();
+    int32 count = 0;
+    for( int32 i = 0; i < changed.Num(); ++i )
+    {
+        if( changed[i] >= 0 && changed[i] < vertices.Num() && (count == 0 || changed[count - 1] != changed[i]) )
+        {
+            changed[count++] = changed[i];
+        }
+    }
+    changed.SetNum( count, false );
+
+    for( int32 v : changed )
+    {
+        normals[v] = vertex_normal( v, vertices, triangles );
+    }
+}
+
+void displacement::benchmark()
+{
+    fbm_source noise( 1337 );
+    for( uint8 level = 7; level <= 9; ++level )
+    {
+        const icosphere &base = sphere_batch::shared().get_base( level );
+        TArray<int> triangles( base.get_triangles_raw(), base.get_index_count() );
+        TArray<FVector> vertices( base.get_vertices() );
+        TArray<FVector> normals;
+        displacement stage;
+        displacement_stats stats = stage.displace( noise, 1.f, 0.05f, triangles, vertices, normals );
+        logInfoC(Geometry,DColor::Cyan,true,"Displacement benchmark level %d {vertices: %d, vertices/s: %.0f}",level,stats.vertices,stats.vertices_per_second);
+    }
+}
@@ -0,0 +1,94 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Math/VectorRegister.h"
+#include "adjacency.h"
+
+/**
+* Where displacement heights come from. Sources are handed whole batches in structure of arrays form,
+* so a source can work across a batch instead of one vertex at a time.
+*/
+class height_source
+{
+public:
+    virtual ~height_source(){}
+    // (x, y, z) are unit directions from the centre
+    virtual void sample( const float* x, const float* y, const float* z, float* heights, int32 count ) const = 0;
+};
+
+/**
+* Equirectangular map, row major, bilinear, sampled from the direction alone. u is the longitude atan2(x, z) / 2pi
+* wrapped to [0, 1), starting at +Z and increasing toward +X. v is the latitude acos(y) / pi, from +Y down to -Y.
+* Wraps around in u, clamps at the poles in v
+*/
+class heightmap_source : public height_source
+{
+private:
+    TArray<float> m_texels;
+    int32 m_width;
+    int32 m_height;
+
+public:
+    heightmap_source( const TArray<float> &texels, int32 width, int32 height );
+    virtual void sample( const float* x, const float* y, const float* z, float* heights, int32 count ) const override;
+    bool is_valid() const { return m_width > 0 && m_height > 0 && m_texels.Num() == m_width * m_height; }
+};
+
+/** Fractal sum of 3D gradient noise, roughly within [-1, 1]. Four directions are evaluated at once, one per vector lane */
+class fbm_source : public height_source
+{
+private:
+    uint8 m_permutation[512];
+    int32 m_octaves;
+    float m_frequency;
+    float m_lacunarity;
+    float m_gain;
+
+protected:
+    VectorRegister noise( const VectorRegister &x, const VectorRegister &y, const VectorRegister &z ) const;
+
+public:
+    fbm_source( int32 seed, int32 octaves = 6, float frequency = 2.f, float lacunarity = 2.f, float gain = 0.5f );
+    virtual void sample( const float* x, const float* y, const float* z, float* heights, int32 count ) const override;
+};
+
+struct displacement_stats
+{
+    int32 vertices = 0;
+    double displace_seconds = 0.0;
+    double normal_seconds = 0.0;
+    double vertices_per_second = 0.0;
+};
+
+/**
+* Displacement stage
+*********************
+*
+* Moves every vertex to radius + scale * height along its own direction, so it can be applied again with new
+* heights without drifting. Vertices are processed in parallel batches, each batch is split into x/y/z arrays
+* and normalized, sampled and scaled four vertices per vector register. fbm_source samples four per register as
+* well, heightmap_source looks texels up one vertex at a time.
+* Smooth normals are then rebuilt from the area weighted normals of the triangles around each vertex.
+*/
+class displacement
+{
+private:
+    mesh_adjacency m_vertex_triangles;
+    int32 m_vert_count = 0;
+    int32 m_index_count = 0;
+
+protected:
+    void update_adjacency( const TArray<FVector> &vertices, const TArray<int> &triangles );
+    FVector vertex_normal( int32 vertex, const TArray<FVector> &vertices, const TArray<int> &triangles ) const;
+
+public:
+    displacement_stats displace( const height_source &source, float radius, float scale, const TArray<int> &triangles, TArray<FVector> &vertices, TArray<FVector> &normals );
+    void smooth_normals( const TArray<FVector> &vertices, const TArray<int> &triangles, TArray<FVector> &normals );
+    // after only `changed` moved: adds their one-ring to `changed` (sorted, no duplicates) and recomputes the normals of all of them
+    void smooth_normals( const TArray<FVector> &vertices, const TArray<int> &triangles, TArray<int32> &changed, TArray<FVector> &normals );
+
+    // logs vertices per second of an fBm displacement on levels 7 to 9
+    static void benchmark();
+};
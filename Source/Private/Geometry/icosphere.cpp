@@ -68,7 +68,7 @@ void FindUV( const FVector &normal, FVector2D &uv )
     logVeryVerbose(Geometry,"\nnorm.x = %.15f\nnorm.y = %.15f\nnorm.z = %.15f\nnormalizedX = %.15f\nnormalizedZ = %.15f\nU = %.15f\nV = %.15f", x,y,z,normalisedX,normalisedZ,uv.X,uv.Y);
 }
 
-void icosphere::make_icosphere( uint8 subdivisions )
+void icosphere::make_icosphere( uint8 subdivisions, bool map_uv )
 {
     logInfoC(Geometry,DColor::Cyan,true,"Making icosphere with (%d) subdivisions.", subdivisions);
     m_vertices.Reset( 16 );
@@ -83,7 +83,10 @@ void icosphere::make_icosphere( uint8 subdivisions )
         logInfo(Geometry,"Subdividing icosphere\niteration: %d\ncurrent vertex count: %d",i,m_vertices.Num());
         subdivide();
     }
-    mapuv();
+    if( map_uv )
+    {
+        mapuv();
+    }
 }
 
 void icosphere::normalize()
@@ -143,7 +146,7 @@ void icosphere::subdivide()
 void icosphere::mapuv()
 {
     logInfoC(Geometry,DColor::Cyan,true,"Creating UV Mapping");
-    m_uvmapping.Empty(m_vertices.Num());
+    m_uvmapping.SetNumUninitialized(m_vertices.Num());
     for( int32 i = 0; i < m_vertices.Num(); ++i )
     {
         FindUV( m_vertices[i], *(m_uvmapping.GetData() + i) );
@@ -71,14 +71,15 @@ private:
 protected:
     uint32 vertex_for_edge( uint32 vert_index_1, uint32 vert_index_2 );
     void subdivide();
-    void mapuv();
 
 public:
     icosphere(){}
     icosphere(const icosphere &other);
     icosphere( uint8 subdivisions );
     ~icosphere();
-    void make_icosphere( uint8 subdivisions );
+    // map_uv can be turned off to run mapuv() separately, as a later stage
+    void make_icosphere( uint8 subdivisions, bool map_uv = true );
+    void mapuv();
     // normalizing should be redundant. todo: delete
     void normalize();
 
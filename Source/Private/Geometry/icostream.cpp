@@ -0,0 +1,364 @@
+#include "icostream.h"
+#include "core.h"
+#include "HAL/PlatformFilemanager.h"
+#include "GenericPlatform/GenericPlatformFile.h"
+
+
+//keeps a patch at or below 4^8 triangles, no matter the subdivision level
+static const int32 patch_depth = 8;
+
+//normalized the same way icosphere::normalize() does it, so positions match bit for bit
+static FVector corner( uint32 index )
+{
+    FVector point = icosahedron::vertices[index];
+    point.Normalize();
+    return point;
+}
+
+struct icostream_header
+{
+    uint32 magic;
+    uint32 version;
+    uint32 subdivisions;
+    uint32 vert_count;
+    uint32 tri_count;
+};
+
+void icosphere_callback_sink::vertices( const streamed_vertex* verts, int32 count )
+{
+    if( on_vertices )
+    {
+        on_vertices( verts, count );
+    }
+}
+
+void icosphere_callback_sink::triangles( uint32 first, const Triangle* tris, int32 count )
+{
+    if( on_triangles )
+    {
+        on_triangles( first, tris, count );
+    }
+}
+
+icosphere_file_sink::icosphere_file_sink( const FString &path )
+    : m_path( path )
+{
+}
+
+icosphere_file_sink::~icosphere_file_sink()
+{
+    //closes the file if end() was never reached
+}
+
+bool icosphere_file_sink::begin( uint8 subdivisions, uint32 vert_count, uint32 tri_count )
+{
+    IPlatformFile &platform = FPlatformFileManager::Get().GetPlatformFile();
+    m_file.Reset( platform.OpenWrite( *m_path ) );
+    if( !m_file )
+    {
+        logError(Geometry,"Cannot open '%s' for writing.",*m_path);
+        return false;
+    }
+    icostream_header header = {magic, version, subdivisions, vert_count, tri_count};
+    m_file->Write( (const uint8*)&header, sizeof( header ) );
+    m_vert_offset = sizeof( header );
+    m_tri_offset = m_vert_offset + (int64)vert_count * sizeof( FVector );
+    return true;
+}
+
+void icosphere_file_sink::vertices( const streamed_vertex* verts, int32 count )
+{
+    if( !m_file )
+    {
+        return;
+    }
+    //vertices arrive sorted, so neighbouring indices are coalesced into a single write
+    const int32 run_capacity = 256;
+    FVector run[run_capacity];
+    int32 run_length = 0;
+    uint32 run_start = 0;
+    for( int32 k = 0; k <= count; ++k )
+    {
+        bool contiguous = k < count && run_length > 0 && run_length < run_capacity && verts[k].index == run_start + run_length;
+        if( run_length > 0 && !contiguous )
+        {
+            m_file->Seek( m_vert_offset + (int64)run_start * sizeof( FVector ) );
+            m_file->Write( (const uint8*)run, run_length * sizeof( FVector ) );
+            run_length = 0;
+        }
+        if( k < count )
+        {
+            if( run_length == 0 )
+            {
+                run_start = verts[k].index;
+            }
+            run[run_length++] = verts[k].position;
+        }
+    }
+}
+
+void icosphere_file_sink::triangles( uint32 first, const Triangle* tris, int32 count )
+{
+    if( !m_file )
+    {
+        return;
+    }
+    m_file->Seek( m_tri_offset + (int64)first * sizeof( Triangle ) );
+    m_file->Write( (const uint8*)tris, (int64)count * sizeof( Triangle ) );
+}
+
+void icosphere_file_sink::end()
+{
+    if( m_file )
+    {
+        m_file->Flush();
+        m_file.Reset();
+        logInfo(Geometry,"Wrote streamed icosphere to '%s'.",*m_path);
+    }
+}
+
+
+uint32 icostream::get_vert_count( uint8 subdivisions )
+{
+    uint32 n = 1u << subdivisions;
+    return 10 * n * n + 2;
+}
+
+uint32 icostream::get_tri_count( uint8 subdivisions )
+{
+    uint32 n = 1u << subdivisions;
+    return 20 * n * n;
+}
+
+icostream::icostream( uint8 subdivisions )
+{
+    LOGINIT(DColor::Green);
+    if( subdivisions > max_subdivisions )
+    {
+        logError(Geometry,"Cannot stream (%d) subdivisions, indices would overflow. Clamping to (%d).",subdivisions,max_subdivisions);
+        subdivisions = max_subdivisions;
+    }
+    m_subdivisions = subdivisions;
+    m_patch_level = FMath::Max( 0, subdivisions - patch_depth );
+    m_n = 1u << subdivisions;
+    m_face_interior = m_n > 1 ? (m_n - 1) * (m_n - 2) / 2 : 0;
+
+    //number the 30 icosahedron edges in the order they are first met
+    std::umap<std::pair<uint32, uint32>, uint32> edge_ids;
+    for( uint32 f = 0; f < ARRAY_COUNT( icosahedron::triangles ); ++f )
+    {
+        const Triangle &face = icosahedron::triangles[f];
+        for( int32 e = 0; e < 3; ++e )
+        {
+            uint32 a = face.vert[e];
+            uint32 b = face.vert[(e + 1) % 3];
+            std::pair<uint32, uint32> key( std::min( a, b ), std::max( a, b ) );
+            auto inserted = edge_ids.insert( {key, (uint32)m_edges.Num()} );
+            if( inserted.second )
+            {
+                m_edges.Add( {key.first, key.second} );
+            }
+            m_face_edges[f][e] = inserted.first->second;
+        }
+    }
+}
+
+uint32 icostream::edge_vertex( uint32 face_edge, uint32 from, uint32 steps ) const
+{
+    uint32 e = m_face_edges[m_face][face_edge];
+    if( m_edges[e].a != from )
+    {
+        steps = m_n - steps;
+    }
+    return 12 + e * (m_n - 1) + (steps - 1);
+}
+
+uint32 icostream::vertex_index( int32 i, int32 j ) const
+{
+    // (i,j) are the steps taken from corner 0 toward corner 1 and corner 2 respectively
+    const Triangle &face = icosahedron::triangles[m_face];
+    const int32 n = m_n;
+    if( i == 0 && j == 0 )
+    {
+        return face.vert[0];
+    }
+    if( i == n )
+    {
+        return face.vert[1];
+    }
+    if( j == n )
+    {
+        return face.vert[2];
+    }
+    if( j == 0 )
+    {
+        return edge_vertex( 0, face.vert[0], i );
+    }
+    if( i + j == n )
+    {
+        return edge_vertex( 1, face.vert[1], j );
+    }
+    if( i == 0 )
+    {
+        return edge_vertex( 2, face.vert[0], j );
+    }
+    uint32 row = (j - 1) * (m_n - 1) - (uint32)((j - 1) * j) / 2;
+    return 12 + 30 * (m_n - 1) + m_face * m_face_interior + row + (i - 1);
+}
+
+void icostream::emit_vertex( uint32 index, const FVector &position )
+{
+    m_vert_buffer.Add( {index, position} );
+}
+
+void icostream::flush()
+{
+    if( m_vert_buffer.Num() > 0 )
+    {
+        m_vert_buffer.Sort( []( const streamed_vertex &A, const streamed_vertex &B ){ return A.index < B.index; } );
+        m_sink->vertices( m_vert_buffer.GetData(), m_vert_buffer.Num() );
+        m_stats.vertices += m_vert_buffer.Num();
+        m_vert_buffer.Reset();
+    }
+    if( m_tri_buffer.Num() > 0 )
+    {
+        m_sink->triangles( m_next_triangle, m_tri_buffer.GetData(), m_tri_buffer.Num() );
+        m_next_triangle += m_tri_buffer.Num();
+        m_stats.triangles += m_tri_buffer.Num();
+        m_tri_buffer.Reset();
+    }
+}
+
+void icostream::stream_corners()
+{
+    for( uint32 c = 0; c < ARRAY_COUNT( icosahedron::vertices ); ++c )
+    {
+        emit_vertex( c, corner( c ) );
+    }
+    flush();
+}
+
+void icostream::stream_edges()
+{
+    // an edge vertex only ever depends on the two vertices of its parent segment, so bisecting the edge
+    // on its own gives the same positions the faces on either side will compute
+    TArray<FVector> edge_points;
+    edge_points.SetNumUninitialized( m_n + 1 );
+    for( int32 e = 0; e < m_edges.Num(); ++e )
+    {
+        edge_points[0] = corner( m_edges[e].a );
+        edge_points[m_n] = corner( m_edges[e].b );
+        for( uint32 span = m_n; span > 1; span /= 2 )
+        {
+            for( uint32 lo = 0; lo < m_n; lo += span )
+            {
+                FVector point = edge_points[lo] + edge_points[lo + span];
+                point.Normalize();
+                edge_points[lo + span / 2] = point;
+            }
+        }
+        for( uint32 t = 1; t < m_n; ++t )
+        {
+            emit_vertex( 12 + e * (m_n - 1) + (t - 1), edge_points[t] );
+        }
+        flush();
+    }
+}
+
+void icostream::stream_face( uint32 face )
+{
+    m_face = face;
+    const Triangle &tri = icosahedron::triangles[face];
+    node root;
+    for( int32 c = 0; c < 3; ++c )
+    {
+        root.p[c] = corner( tri.vert[c] );
+    }
+    root.i[0] = 0; root.i[1] = m_n; root.i[2] = 0;
+    root.j[0] = 0; root.j[1] = 0; root.j[2] = m_n;
+    root.up = true;
+    subdivide( root, 0 );
+    flush();
+}
+
+void icostream::subdivide( const node &tri, int32 level )
+{
+    if( level == m_subdivisions )
+    {
+        m_tri_buffer.Add( {(int)vertex_index( tri.i[0], tri.j[0] ), (int)vertex_index( tri.i[1], tri.j[1] ), (int)vertex_index( tri.i[2], tri.j[2] )} );
+        return;
+    }
+
+    // same midpoints and child order as icosphere::subdivide()
+    FVector mid[3];
+    int32 mi[3];
+    int32 mj[3];
+    for( int32 edge = 0; edge < 3; ++edge )
+    {
+        int32 a = edge;
+        int32 b = (edge + 1) % 3;
+        mid[edge] = tri.p[a] + tri.p[b];
+        mid[edge].Normalize();
+        mi[edge] = (tri.i[a] + tri.i[b]) / 2;
+        mj[edge] = (tri.j[a] + tri.j[b]) / 2;
+        bool interior = mi[edge] > 0 && mj[edge] > 0 && mi[edge] + mj[edge] < (int32)m_n;
+        if( tri.up && interior )
+        {
+            emit_vertex( vertex_index( mi[edge], mj[edge] ), mid[edge] );
+        }
+    }
+
+    const node children[4] =
+    {
+        {{tri.p[0], mid[0], mid[2]}, {tri.i[0], mi[0], mi[2]}, {tri.j[0], mj[0], mj[2]}, tri.up},
+        {{tri.p[1], mid[1], mid[0]}, {tri.i[1], mi[1], mi[0]}, {tri.j[1], mj[1], mj[0]}, tri.up},
+        {{tri.p[2], mid[2], mid[1]}, {tri.i[2], mi[2], mi[1]}, {tri.j[2], mj[2], mj[1]}, tri.up},
+        {{mid[0], mid[1], mid[2]}, {mi[0], mi[1], mi[2]}, {mj[0], mj[1], mj[2]}, !tri.up}
+    };
+    for( const node &child : children )
+    {
+        subdivide( child, level + 1 );
+    }
+    if( level == m_patch_level )
+    {
+        flush();
+    }
+}
+
+icostream_stats icostream::run( icosphere_sink &sink )
+{
+    m_stats = icostream_stats();
+    m_sink = &sink;
+    m_next_triangle = 0;
+    uint32 vert_count = get_vert_count( m_subdivisions );
+    uint32 tri_count = get_tri_count( m_subdivisions );
+    logInfoC(Geometry,DColor::Cyan,true,"Streaming icosphere with (%d) subdivisions. {vertices: %u, triangles: %u}",m_subdivisions,vert_count,tri_count);
+    if( !sink.begin( m_subdivisions, vert_count, tri_count ) )
+    {
+        logError(Geometry,"Sink refused the stream.");
+        m_sink = nullptr;
+        return m_stats;
+    }
+
+    const int32 patch_tris = 1 << (2 * FMath::Min( (int32)m_subdivisions, patch_depth ));
+    m_tri_buffer.Reset( patch_tris );
+    m_vert_buffer.Reset( patch_tris / 2 + 3 * (1 << FMath::Min( (int32)m_subdivisions, patch_depth )) );
+
+    double start = FPlatformTime::Seconds();
+    stream_corners();
+    stream_edges();
+    for( uint32 f = 0; f < ARRAY_COUNT( icosahedron::triangles ); ++f )
+    {
+        logVerbose(Geometry,"Streaming face %d",f);
+        stream_face( f );
+    }
+    sink.end();
+    m_stats.seconds = FPlatformTime::Seconds() - start;
+    m_stats.triangles_per_second = m_stats.seconds > 0.0 ? m_stats.triangles / m_stats.seconds : 0.0;
+
+    logInfoC(Geometry,DColor::Cyan,true,"Streamed icosphere {vertices: %llu, triangles: %llu, seconds: %.3f, triangles/s: %.0f}",m_stats.vertices,m_stats.triangles,m_stats.seconds,m_stats.triangles_per_second);
+    m_vert_buffer.Empty();
+    m_tri_buffer.Empty();
+    m_sink = nullptr;
+    return m_stats;
+}
@@ -0,0 +1,129 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "icosphere.h"
+
+/**
+* Out-of-core icosphere generation
+***********************************
+*
+* Emits an icosphere of the requested subdivision level to a sink, one icosahedron face at a time,
+* without ever holding the whole mesh. Working memory is one patch of (at most) 4^8 triangles.
+*
+* Positions are bit-identical to icosphere::make_icosphere(), and triangles come out in the same order
+* (triangle t at level k owns triangles 4t..4t+3 at level k+1). Vertex numbering is different though,
+* it is derived from where the vertex sits on its icosahedron face so any patch can compute it alone:
+*   [0, 12)                          icosahedron corners
+*   [12, 12 + 30(n-1))               vertices on the 30 icosahedron edges, n-1 per edge
+*   [12 + 30(n-1), 10n^2 + 2)        vertices inside the 20 faces, (n-1)(n-2)/2 per face
+* where n = 2^subdivisions. Every vertex is emitted exactly once, before the end of the run.
+*/
+
+struct streamed_vertex
+{
+    uint32 index;
+    FVector position;
+};
+
+class icosphere_sink
+{
+public:
+    virtual ~icosphere_sink(){}
+    // returning false aborts the run before anything is generated
+    virtual bool begin( uint8 subdivisions, uint32 vert_count, uint32 tri_count ) { return true; }
+    // vertices are sorted by index within a call, but calls are not ordered relative to each other
+    virtual void vertices( const streamed_vertex* verts, int32 count ) = 0;
+    // triangles are always emitted in order, `first` is the index of tris[0]
+    virtual void triangles( uint32 first, const Triangle* tris, int32 count ) = 0;
+    virtual void end(){}
+};
+
+class icosphere_callback_sink : public icosphere_sink
+{
+public:
+    TFunction<void( const streamed_vertex*, int32 )> on_vertices;
+    TFunction<void( uint32, const Triangle*, int32 )> on_triangles;
+
+    virtual void vertices( const streamed_vertex* verts, int32 count ) override;
+    virtual void triangles( uint32 first, const Triangle* tris, int32 count ) override;
+};
+
+/** Writes a flat binary: header, FVector[vert_count] indexed by vertex, Triangle[tri_count] */
+class icosphere_file_sink : public icosphere_sink
+{
+private:
+    FString m_path;
+    TUniquePtr<class IFileHandle> m_file;
+    int64 m_vert_offset = 0;
+    int64 m_tri_offset = 0;
+
+public:
+    static const uint32 magic = 0x534F4349; //"ICOS"
+    static const uint32 version = 1;
+
+    icosphere_file_sink( const FString &path );
+    ~icosphere_file_sink();
+    virtual bool begin( uint8 subdivisions, uint32 vert_count, uint32 tri_count ) override;
+    virtual void vertices( const streamed_vertex* verts, int32 count ) override;
+    virtual void triangles( uint32 first, const Triangle* tris, int32 count ) override;
+    virtual void end() override;
+};
+
+struct icostream_stats
+{
+    uint64 vertices = 0;
+    uint64 triangles = 0;
+    double seconds = 0.0;
+    double triangles_per_second = 0.0;
+};
+
+class icostream
+{
+private:
+    struct node
+    {
+        FVector p[3];
+        int32 i[3];
+        int32 j[3];
+        bool up; //every edge of the grid has one up-triangle and one down-triangle, up-triangles own the midpoints
+    };
+    struct edge
+    {
+        uint32 a;
+        uint32 b;
+    };
+
+    uint8 m_subdivisions;
+    int32 m_patch_level;
+    uint32 m_n;
+    uint32 m_face_interior;
+    uint32 m_face;
+    uint32 m_next_triangle;
+    TArray<edge> m_edges;
+    int32 m_face_edges[20][3];
+    TArray<streamed_vertex> m_vert_buffer;
+    TArray<Triangle> m_tri_buffer;
+    icosphere_sink* m_sink = nullptr;
+    icostream_stats m_stats;
+
+protected:
+    uint32 edge_vertex( uint32 face_edge, uint32 from, uint32 steps ) const;
+    uint32 vertex_index( int32 i, int32 j ) const;
+    void emit_vertex( uint32 index, const FVector &position );
+    void stream_corners();
+    void stream_edges();
+    void stream_face( uint32 face );
+    void subdivide( const node &tri, int32 level );
+    void flush();
+
+public:
+    static const uint8 max_subdivisions = 13;
+
+    icostream( uint8 subdivisions );
+    icostream_stats run( icosphere_sink &sink );
+
+    static uint32 get_vert_count( uint8 subdivisions );
+    static uint32 get_tri_count( uint8 subdivisions );
+};
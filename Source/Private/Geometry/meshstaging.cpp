@@ -0,0 +1,46 @@
+#include "meshstaging.h"
+#include "core.h"
+
+
+mesh_staging::mesh_staging( const FProcMeshSection &shape, int32 buffer_count )
+    : m_vert_count( shape.ProcVertexBuffer.Num() )
+{
+    logInfoC(Geometry,DColor::Cyan,false,"Allocating %d staging buffers {vertices: %d, indices: %d}",buffer_count,shape.ProcVertexBuffer.Num(),shape.ProcIndexBuffer.Num());
+    for( int32 b = 0; b < buffer_count; ++b )
+    {
+        m_free.Add( MakeShareable( new FProcMeshSection( shape ) ) );
+    }
+}
+
+mesh_staging::buffer mesh_staging::acquire()
+{
+    FScopeLock lock( &m_lock );
+    return m_free.Num() > 0 ? m_free.Pop( false ) : buffer();
+}
+
+void mesh_staging::publish( buffer &&filled )
+{
+    FScopeLock lock( &m_lock );
+    ++m_published;
+    if( m_ready.IsValid() )
+    {
+        ++m_dropped;
+        logVerbose(Geometry,"Staged frame dropped before it was presented {published: %u, dropped: %u}",m_published,m_dropped);
+        m_free.Add( MoveTemp( m_ready ) );
+    }
+    m_ready = MoveTemp( filled );
+}
+
+mesh_staging::buffer mesh_staging::take_ready()
+{
+    FScopeLock lock( &m_lock );
+    buffer ready = MoveTemp( m_ready );
+    m_ready.Reset();
+    return ready;
+}
+
+void mesh_staging::recycle( buffer &&presented )
+{
+    FScopeLock lock( &m_lock );
+    m_free.Add( MoveTemp( presented ) );
+}
@@ -0,0 +1,41 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ProceduralMeshComponent.h"
+
+/**
+* Pre-allocated back buffers for a procedural mesh section
+***********************************************************
+*
+* Buffers move between three places: free, being filled by a worker, and ready to be presented.
+* Presenting swaps a ready buffer with the live section, and what was live comes back as a free buffer,
+* so after the first frames no array is ever allocated or copied element by element.
+* When a newer frame is published before the older one was presented, the older one is dropped.
+*/
+class mesh_staging
+{
+public:
+    using buffer = TSharedPtr<FProcMeshSection, ESPMode::ThreadSafe>;
+
+private:
+    FCriticalSection m_lock;
+    TArray<buffer> m_free;
+    buffer m_ready;
+    int32 m_vert_count;
+    uint32 m_published = 0;
+    uint32 m_dropped = 0;
+
+public:
+    // every buffer starts as a copy of `shape`, later fills only overwrite what they change
+    mesh_staging( const FProcMeshSection &shape, int32 buffer_count );
+
+    // null when every buffer is in use
+    buffer acquire();
+    void publish( buffer &&filled );
+    buffer take_ready();
+    void recycle( buffer &&presented );
+
+    int32 get_vert_count() const { return m_vert_count; }
+};
@@ -0,0 +1,167 @@
+#include "spherebatch.h"
+#include "core.h"
+#include "Math/RandomStream.h"
+
+
+//number of seeded bumps laid over a deformed sphere
+static const int32 bump_count = 8;
+
+sphere_batch& sphere_batch::shared()
+{
+    static sphere_batch instance;
+    return instance;
+}
+
+sphere_batch::base_entry sphere_batch::schedule_base( uint8 subdivisions )
+{
+    FScopeLock lock( &m_lock );
+    if( base_entry* found = m_bases.Find( subdivisions ) )
+    {
+        return *found;
+    }
+
+    logInfoC(Geometry,DColor::Green,false,"Scheduling shared icosphere with (%d) subdivisions.",subdivisions);
+    base_entry entry;
+    entry.sphere = MakeShareable( new icosphere() );
+    shared_sphere sphere = entry.sphere;
+    FGraphEventArray generated;
+    generated.Add( FFunctionGraphTask::CreateAndDispatchWhenReady( [sphere, subdivisions](){
+        sphere->make_icosphere( subdivisions, false );
+    } ) );
+    entry.ready = FFunctionGraphTask::CreateAndDispatchWhenReady( [sphere](){
+        sphere->mapuv();
+    }, TStatId(), &generated );
+    m_bases.Add( subdivisions, entry );
+    return entry;
+}
+
+const icosphere& sphere_batch::get_base( uint8 subdivisions )
+{
+    base_entry entry = schedule_base( subdivisions );
+    if( !entry.ready->IsComplete() )
+    {
+        FTaskGraphInterface::Get().WaitUntilTaskCompletes( entry.ready );
+    }
+    return *entry.sphere;
+}
+
+FGraphEventRef sphere_batch::submit( const TArray<sphere_request> &requests, completion on_complete, ENamedThreads::Type complete_on )
+{
+    logInfoC(Geometry,DColor::Cyan,false,"Submitting %d sphere requests.",requests.Num());
+    FGraphEventArray completed;
+    for( int32 r = 0; r < requests.Num(); ++r )
+    {
+        const sphere_request request = requests[r];
+        base_entry base = schedule_base( request.subdivisions );
+        shared_sphere sphere = base.sphere;
+        TSharedRef<sphere_result, ESPMode::ThreadSafe> result = MakeShareable( new sphere_result() );
+        result->request = r;
+
+        FGraphEventArray base_ready;
+        base_ready.Add( base.ready );
+        FGraphEventArray built;
+        built.Add( FFunctionGraphTask::CreateAndDispatchWhenReady( [sphere, request, result](){
+            build( *sphere, request, *result );
+        }, TStatId(), &base_ready ) );
+        completed.Add( FFunctionGraphTask::CreateAndDispatchWhenReady( [on_complete, result](){
+            on_complete( *result );
+        }, TStatId(), &built, complete_on ) );
+    }
+    return FFunctionGraphTask::CreateAndDispatchWhenReady( [](){}, TStatId(), &completed );
+}
+
+void sphere_batch::build( const icosphere &base, const sphere_request &request, sphere_result &result )
+{
+    const TArray<FVector> &unit = base.get_vertices();
+    result.radius = request.radius;
+    result.triangles = TArray<int>( base.get_triangles_raw(), base.get_index_count() );
+    result.uvmapping = base.get_uvmapping();
+    result.vertices.SetNumUninitialized( unit.Num() );
+
+    if( request.seed == 0 || FMath::IsNearlyZero( request.deformation ) )
+    {
+        result.normals = unit;
+        for( int32 i = 0; i < unit.Num(); ++i )
+        {
+            result.vertices[i] = unit[i] * request.radius;
+        }
+        return;
+    }
+    result.normals.SetNumUninitialized( unit.Num() );
+
+    // smooth bumps and dents, so the same seed always gives the same planet
+    FRandomStream stream( request.seed );
+    FVector centre[bump_count];
+    float height[bump_count];
+    float reach[bump_count]; //cosine of the bump's angular radius
+    for( int32 k = 0; k < bump_count; ++k )
+    {
+        centre[k] = stream.GetUnitVector();
+        height[k] = stream.FRandRange( -1.f, 1.f ) * request.deformation;
+        reach[k] = FMath::Cos( stream.FRandRange( 0.2f, 0.8f ) );
+    }
+    for( int32 i = 0; i < unit.Num(); ++i )
+    {
+        const FVector &u = unit[i];
+        float offset = 0.f;
+        FVector gradient = FVector::ZeroVector; //of offset, along the sphere's surface
+        for( int32 k = 0; k < bump_count; ++k )
+        {
+            const float cosine = FVector::DotProduct( u, centre[k] );
+            float t = (cosine - reach[k]) / (1.f - reach[k]);
+            if( t > 0.f )
+            {
+                offset += height[k] * FMath::SmoothStep( 0.f, 1.f, t );
+                if( t < 1.f )
+                {
+                    gradient += (height[k] * 6.f * t * (1.f - t) / (1.f - reach[k])) * (centre[k] - cosine * u);
+                }
+            }
+        }
+        if( FMath::Abs( offset ) > request.deformation )
+        {
+            offset = FMath::Clamp( offset, -request.deformation, request.deformation );
+            gradient = FVector::ZeroVector;
+        }
+        result.vertices[i] = u * (request.radius * (1.f + offset));
+        //a surface at radius r(u) along u has its normal along u - grad(r) / r
+        result.normals[i] = (u - gradient / (1.f + offset)).GetSafeNormal();
+    }
+}
+
+void sphere_batch::benchmark( int32 count )
+{
+    TArray<sphere_request> requests;
+    for( int32 i = 0; i < count; ++i )
+    {
+        sphere_request request;
+        request.subdivisions = 4 + i % 4;
+        request.radius = 100.f * (1 + i % 5);
+        request.seed = i + 1;
+        request.deformation = 0.1f;
+        requests.Add( request );
+    }
+
+    //both sides build from the same cached bases, generated before timing, so only the job graph is measured
+    sphere_batch batch;
+    for( uint8 level = 4; level < 8; ++level )
+    {
+        batch.get_base( level );
+    }
+
+    //one request after another on this thread
+    double start = FPlatformTime::Seconds();
+    for( const sphere_request &request : requests )
+    {
+        sphere_result result;
+        build( batch.get_base( request.subdivisions ), request, result );
+    }
+    double serial = FPlatformTime::Seconds() - start;
+
+    start = FPlatformTime::Seconds();
+    FGraphEventRef done = batch.submit( requests, []( sphere_result &result ){}, ENamedThreads::AnyThread );
+    FTaskGraphInterface::Get().WaitUntilTaskCompletes( done );
+    double batched = FPlatformTime::Seconds() - start;
+
+    logInfoC(Geometry,DColor::Cyan,true,"Sphere batch benchmark {spheres: %d, serial: %.3f s, batched: %.3f s, speedup: %.2fx}",count,serial,batched,batched > 0.0 ? serial / batched : 0.0);
+}
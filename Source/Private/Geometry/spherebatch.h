@@ -0,0 +1,68 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "icosphere.h"
+
+struct sphere_request
+{
+    uint8 subdivisions = 9;
+    float radius = 1.f;
+    int32 seed = 0;
+    // largest radial offset the seeded bumps may reach, as a fraction of the radius. 0 leaves the sphere round
+    float deformation = 0.f;
+};
+
+struct sphere_result
+{
+    int32 request = INDEX_NONE; //index of the request in the submitted batch
+    float radius = 0.f;
+    TArray<int> triangles;
+    TArray<FVector> vertices;
+    TArray<FVector> normals;
+    TArray<FVector2D> uvmapping;
+};
+
+/**
+* Batch sphere jobs
+********************
+*
+* Unit icospheres are generated once per subdivision level and shared by every request (and every batch)
+* asking for that level. Each batch becomes a task graph:
+*   generate base (once per level) -> map uv (once per level) -> build request -> complete request
+* Requests of a level start building as soon as that level's base is ready, so small levels finish
+* while large ones are still subdividing. The completion runs on the thread given to submit(),
+* the game thread by default so it can upload straight to a mesh component.
+*/
+class sphere_batch
+{
+public:
+    using completion = TFunction<void( sphere_result &result )>;
+    using shared_sphere = TSharedPtr<icosphere, ESPMode::ThreadSafe>;
+
+private:
+    struct base_entry
+    {
+        shared_sphere sphere;
+        FGraphEventRef ready;
+    };
+    FCriticalSection m_lock;
+    TMap<uint8, base_entry> m_bases;
+
+protected:
+    base_entry schedule_base( uint8 subdivisions );
+
+public:
+    static sphere_batch& shared();
+
+    // blocks until the base for this level exists. The reference stays valid for the life of the batch object
+    const icosphere& get_base( uint8 subdivisions );
+    // returns an event that completes once every completion has run
+    FGraphEventRef submit( const TArray<sphere_request> &requests, completion on_complete, ENamedThreads::Type complete_on = ENamedThreads::GameThread );
+
+    static void build( const icosphere &base, const sphere_request &request, sphere_result &result );
+    // logs wall time of building `count` mixed level spheres as a batch against one after another, from the same bases
+    static void benchmark( int32 count = 100 );
+};
@@ -0,0 +1,371 @@
+#include "spherebvh.h"
+#include "core.h"
+#include "Async/ParallelFor.h"
+
+
+//rays per worker task when tracing a batch
+static const int32 trace_chunk = 64;
+
+//sorted (ascending) array in, duplicates dropped in place
+static void remove_duplicates( TArray<int32> &sorted )
+{
+    int32 count = 0;
+    for( int32 i = 0; i < sorted.Num(); ++i )
+    {
+        if( count == 0 || sorted[count - 1] != sorted[i] )
+        {
+            sorted[count++] = sorted[i];
+        }
+    }
+    sorted.SetNum( count, false );
+}
+
+bool sphere_bvh::build( const TArray<FVector> &vertices, const TArray<int> &triangles )
+{
+    m_subdivisions = -1;
+    const int32 tri_count = triangles.Num() / 3;
+    int32 subdivisions = -1;
+    for( int32 k = 0, count = 20; k <= 13 && count <= tri_count; ++k, count *= 4 )
+    {
+        if( count == tri_count )
+        {
+            subdivisions = k;
+        }
+    }
+    if( subdivisions < 0 || triangles.Num() % 3 != 0 )
+    {
+        logError(Geometry,"Cannot build ray tree, %d triangles is not an icosphere.",tri_count);
+        return false;
+    }
+
+    m_vertices = vertices;
+    m_triangles = triangles;
+    m_directions.SetNumUninitialized( vertices.Num() );
+    for( int32 v = 0; v < vertices.Num(); ++v )
+    {
+        m_directions[v] = vertices[v].GetSafeNormal();
+    }
+
+    m_level_offset.SetNumUninitialized( subdivisions + 2 );
+    m_level_offset[0] = 0;
+    for( int32 k = 0; k <= subdivisions; ++k )
+    {
+        m_level_offset[k + 1] = m_level_offset[k] + (20 << (2 * k));
+    }
+    m_bounds.SetNumUninitialized( m_level_offset[subdivisions + 1] );
+    m_corners.SetNumUninitialized( m_level_offset[subdivisions] );
+    m_subdivisions = subdivisions;
+    logInfoC(Geometry,DColor::Cyan,false,"Building ray tree {subdivisions: %d, triangles: %d, nodes: %d}",subdivisions,tri_count,m_bounds.Num());
+
+    // child c < 3 of a triangle starts with the parent's corner c, so following child c down to the leaves finds corner c
+    for( int32 level = 0; level < subdivisions; ++level )
+    {
+        const int32 shift = 2 * (subdivisions - level - 1);
+        for( int32 node = 0; node < (20 << (2 * level)); ++node )
+        {
+            Triangle &corners = m_corners[m_level_offset[level] + node];
+            for( int32 c = 0; c < 3; ++c )
+            {
+                corners.vert[c] = leaf( (node * 4 + c) << shift )[0];
+            }
+        }
+    }
+    if( !check_layout() )
+    {
+        logError(Geometry,"Cannot build ray tree, the triangles are not in the order icosphere subdivides them.");
+        m_subdivisions = -1;
+        return false;
+    }
+
+    ParallelFor( tri_count, [this]( int32 triangle ){
+        fit_leaf( triangle );
+    } );
+    for( int32 level = subdivisions - 1; level >= 0; --level )
+    {
+        ParallelFor( 20 << (2 * level), [this, level]( int32 node ){
+            fit_node( level, node );
+        } );
+    }
+    m_vertex_triangles.build_vertex_triangles( m_triangles.GetData(), m_triangles.Num(), m_vertices.Num() );
+    return true;
+}
+
+bool sphere_bvh::check_layout() const
+{
+    for( int index : m_triangles )
+    {
+        if( index < 0 || index >= m_vertices.Num() )
+        {
+            return false;
+        }
+    }
+    for( int32 level = 0; level < m_subdivisions; ++level )
+    {
+        const bool above_leaves = level + 1 == m_subdivisions;
+        for( int32 node = 0; node < (20 << (2 * level)); ++node )
+        {
+            const int* parent = m_corners[m_level_offset[level] + node].vert;
+            const int* child[4];
+            for( int32 c = 0; c < 4; ++c )
+            {
+                child[c] = above_leaves ? leaf( node * 4 + c ) : m_corners[m_level_offset[level + 1] + node * 4 + c].vert;
+            }
+            // {v0,m0,m2}, {v1,m1,m0}, {v2,m2,m1}, {m0,m1,m2}
+            const int* middle = child[3];
+            for( int32 c = 0; c < 3; ++c )
+            {
+                if( child[c][0] != parent[c] || child[c][1] != middle[c] || child[c][2] != middle[(c + 2) % 3] )
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void sphere_bvh::refit( const TArray<FVector> &vertices, const TArray<int32> &changed )
+{
+    if( !is_built() )
+    {
+        return;
+    }
+    TArray<int32> dirty;
+    for( int32 v : changed )
+    {
+        if( !m_vertices.IsValidIndex( v ) )
+        {
+            continue;
+        }
+        m_vertices[v] = vertices[v];
+        const int32* touching = m_vertex_triangles.get( v );
+        for( int32 t = 0; t < m_vertex_triangles.num( v ); ++t )
+        {
+            dirty.Add( touching[t] );
+        }
+    }
+    dirty.Sort();
+    remove_duplicates( dirty );
+    logVerbose(Geometry,"Refitting ray tree {vertices: %d, leaves: %d}",changed.Num(),dirty.Num());
+
+    for( int32 triangle : dirty )
+    {
+        fit_leaf( triangle );
+    }
+    for( int32 level = m_subdivisions - 1; level >= 0; --level )
+    {
+        //parents of a sorted list come out sorted
+        for( int32 &node : dirty )
+        {
+            node >>= 2;
+        }
+        remove_duplicates( dirty );
+        for( int32 node : dirty )
+        {
+            fit_node( level, node );
+        }
+    }
+}
+
+void sphere_bvh::fit_leaf( int32 triangle )
+{
+    const int* tri = leaf( triangle );
+    const FVector &a = m_vertices[tri[0]];
+    const FVector &b = m_vertices[tri[1]];
+    const FVector &c = m_vertices[tri[2]];
+    radial_bounds &bounds = m_bounds[m_level_offset[m_subdivisions] + triangle];
+    //a flat triangle bulges inward between its corners, so the lowest point is not necessarily a corner
+    bounds.min = FMath::ClosestPointOnTriangleToPoint( FVector::ZeroVector, a, b, c ).Size();
+    bounds.max = FMath::Sqrt( FMath::Max3( a.SizeSquared(), b.SizeSquared(), c.SizeSquared() ) );
+}
+
+void sphere_bvh::fit_node( int32 level, int32 node )
+{
+    const radial_bounds* children = &m_bounds[m_level_offset[level + 1] + 4 * node];
+    radial_bounds &bounds = m_bounds[m_level_offset[level] + node];
+    bounds = children[0];
+    for( int32 c = 1; c < 4; ++c )
+    {
+        bounds.min = FMath::Min( bounds.min, children[c].min );
+        bounds.max = FMath::Max( bounds.max, children[c].max );
+    }
+}
+
+bool sphere_bvh::enter_node( int32 level, int32 node, const FVector &origin, const FVector &direction, float limit, float &entry ) const
+{
+    const radial_bounds &bounds = m_bounds[m_level_offset[level] + node];
+    const int* corner = level == m_subdivisions ? leaf( node ) : m_corners[m_level_offset[level] + node].vert;
+
+    //outer sphere of the shell
+    float b = FVector::DotProduct( origin, direction );
+    float c = origin.SizeSquared() - bounds.max * bounds.max;
+    float discriminant = b * b - c;
+    if( discriminant < 0.f )
+    {
+        return false;
+    }
+    float root = FMath::Sqrt( discriminant );
+    float t_near = FMath::Max( 0.f, -b - root );
+    float t_far = FMath::Min( limit, -b + root );
+    if( t_near > t_far )
+    {
+        return false;
+    }
+
+    //the three planes through the centre bounding the node's cone, with a little slack for rounding
+    const float slack = KINDA_SMALL_NUMBER * bounds.max;
+    for( int32 edge = 0; edge < 3; ++edge )
+    {
+        const FVector &ua = m_directions[corner[edge]];
+        const FVector &ub = m_directions[corner[(edge + 1) % 3]];
+        const FVector &uc = m_directions[corner[(edge + 2) % 3]];
+        FVector normal = FVector::CrossProduct( ua, ub ).GetSafeNormal();
+        if( FVector::DotProduct( normal, uc ) < 0.f )
+        {
+            normal = -normal;
+        }
+        float distance = FVector::DotProduct( normal, origin ) + slack;
+        float rate = FVector::DotProduct( normal, direction );
+        if( FMath::IsNearlyZero( rate ) )
+        {
+            if( distance < 0.f )
+            {
+                return false;
+            }
+            continue;
+        }
+        float t = -distance / rate;
+        if( rate > 0.f )
+        {
+            t_near = FMath::Max( t_near, t );
+        }
+        else
+        {
+            t_far = FMath::Min( t_far, t );
+        }
+        if( t_near > t_far )
+        {
+            return false;
+        }
+    }
+
+    //what is left of the ray may still pass entirely below the node's triangles
+    const float lowest = bounds.min * bounds.min;
+    if( (origin + direction * t_near).SizeSquared() < lowest && (origin + direction * t_far).SizeSquared() < lowest )
+    {
+        return false;
+    }
+    entry = t_near;
+    return true;
+}
+
+bool sphere_bvh::hit_leaf( int32 triangle, const FVector &origin, const FVector &direction, float limit, sphere_hit &hit ) const
+{
+    //Moller-Trumbore, both sides so rays from inside the sphere hit as well
+    const int* tri = leaf( triangle );
+    const FVector &a = m_vertices[tri[0]];
+    FVector edge1 = m_vertices[tri[1]] - a;
+    FVector edge2 = m_vertices[tri[2]] - a;
+    FVector p = FVector::CrossProduct( direction, edge2 );
+    float determinant = FVector::DotProduct( edge1, p );
+    if( determinant == 0.f )
+    {
+        return false;
+    }
+    float inverse = 1.f / determinant;
+    FVector s = origin - a;
+    float u = FVector::DotProduct( s, p ) * inverse;
+    if( u < 0.f || u > 1.f )
+    {
+        return false;
+    }
+    FVector q = FVector::CrossProduct( s, edge1 );
+    float v = FVector::DotProduct( direction, q ) * inverse;
+    if( v < 0.f || u + v > 1.f )
+    {
+        return false;
+    }
+    float t = FVector::DotProduct( edge2, q ) * inverse;
+    if( t < 0.f || t > limit )
+    {
+        return false;
+    }
+    hit.triangle = triangle;
+    hit.barycentric = FVector( 1.f - u - v, u, v );
+    hit.distance = t;
+    return true;
+}
+
+bool sphere_bvh::trace( const sphere_ray &ray, sphere_hit &hit ) const
+{
+    hit = sphere_hit();
+    if( !is_built() )
+    {
+        return false;
+    }
+
+    struct pending
+    {
+        int32 level;
+        int32 node;
+        float entry;
+    };
+    TArray<pending, TInlineAllocator<64>> stack;
+    float limit = ray.max_distance;
+
+    //children are pushed farthest first, so the nearest one is visited first and can cut the rest short
+    auto visit = [&]( int32 level, int32 first, int32 count ){
+        pending found[20];
+        int32 num = 0;
+        for( int32 node = first; node < first + count; ++node )
+        {
+            float entry;
+            if( enter_node( level, node, ray.origin, ray.direction, limit, entry ) )
+            {
+                int32 slot = num++;
+                for( ; slot > 0 && found[slot - 1].entry < entry; --slot )
+                {
+                    found[slot] = found[slot - 1];
+                }
+                found[slot] = {level, node, entry};
+            }
+        }
+        for( int32 k = 0; k < num; ++k )
+        {
+            stack.Push( found[k] );
+        }
+    };
+
+    visit( 0, 0, 20 );
+    while( stack.Num() > 0 )
+    {
+        pending top = stack.Pop( false );
+        if( top.entry > limit )
+        {
+            continue;
+        }
+        if( top.level == m_subdivisions )
+        {
+            if( hit_leaf( top.node, ray.origin, ray.direction, limit, hit ) )
+            {
+                limit = hit.distance;
+            }
+            continue;
+        }
+        visit( top.level + 1, 4 * top.node, 4 );
+    }
+    return hit.is_hit();
+}
+
+void sphere_bvh::trace( const TArray<sphere_ray> &rays, TArray<sphere_hit> &hits ) const
+{
+    hits.SetNum( rays.Num() );
+    const int32 chunks = FMath::DivideAndRoundUp( rays.Num(), trace_chunk );
+    ParallelFor( chunks, [this, &rays, &hits]( int32 chunk ){
+        const int32 end = FMath::Min( rays.Num(), (chunk + 1) * trace_chunk );
+        for( int32 r = chunk * trace_chunk; r < end; ++r )
+        {
+            trace( rays[r], hits[r] );
+        }
+    } );
+}
@@ -0,0 +1,76 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "icosphere.h"
+#include "adjacency.h"
+
+struct sphere_ray
+{
+    FVector origin;
+    FVector direction; //normalized
+    float max_distance;
+};
+
+struct sphere_hit
+{
+    int32 triangle = INDEX_NONE;
+    FVector barycentric; //weights of the triangle's vert[0], vert[1], vert[2]
+    float distance = 0.f;
+
+    bool is_hit() const { return triangle != INDEX_NONE; }
+};
+
+/**
+* Ray queries against an icosphere mesh
+****************************************
+*
+* No tree is built, the icosphere is already one. icosphere::subdivide() turns triangle t into triangles 4t..4t+3,
+* so on a mesh with L subdivisions the ancestor of triangle t at level k is t >> 2(L-k), with the 20 icosahedron
+* faces as roots. A node covers the cone spanned by the directions of its three corners (its children tile it)
+* and stores the radial range [min, max] its triangles reach inside that cone. A ray only enters the children
+* whose cone and radial shell it crosses.
+*
+* The mesh may be deformed, as long as vertices only move along their own direction from the centre.
+* The triangle order has to be the one icosphere produces. build() checks that every node's four children share
+* their corners and edge midpoints the way subdivide() lays them out, and rejects anything else.
+*/
+class sphere_bvh
+{
+private:
+    struct radial_bounds
+    {
+        float min;
+        float max;
+    };
+
+    int32 m_subdivisions = -1;
+    TArray<FVector> m_vertices;
+    TArray<FVector> m_directions;
+    TArray<int> m_triangles;
+    TArray<int32> m_level_offset;       //first node of each level, leaves are the last level
+    TArray<radial_bounds> m_bounds;     //every node of every level
+    TArray<Triangle> m_corners;         //corner vertices of the nodes above the leaves
+    mesh_adjacency m_vertex_triangles;
+
+protected:
+    const int* leaf( int32 triangle ) const { return m_triangles.GetData() + 3 * triangle; }
+    bool check_layout() const;
+    void fit_leaf( int32 triangle );
+    void fit_node( int32 level, int32 node );
+    bool enter_node( int32 level, int32 node, const FVector &origin, const FVector &direction, float far, float &entry ) const;
+    bool hit_leaf( int32 triangle, const FVector &origin, const FVector &direction, float far, sphere_hit &hit ) const;
+
+public:
+    bool build( const TArray<FVector> &vertices, const TArray<int> &triangles );
+    // re-reads the changed vertices and refits only the nodes above them
+    void refit( const TArray<FVector> &vertices, const TArray<int32> &changed );
+
+    bool trace( const sphere_ray &ray, sphere_hit &hit ) const;
+    // traces every ray on worker threads, hits[i] belongs to rays[i]
+    void trace( const TArray<sphere_ray> &rays, TArray<sphere_hit> &hits ) const;
+
+    bool is_built() const { return m_subdivisions >= 0; }
+    int32 get_subdivisions() const { return m_subdivisions; }
+};
@@ -0,0 +1,240 @@
+#include "spherequery.h"
+#include "spherebatch.h"
+#include "core.h"
+#include "Async/ParallelFor.h"
+#include "Math/RandomStream.h"
+
+
+//queries per worker task when running a batch
+static const int32 query_chunk = 16;
+
+void sphere_query::build( const TArray<FVector> &vertices, const TArray<int> &triangles )
+{
+    logInfoC(Geometry,DColor::Cyan,false,"Building vertex query {vertices: %d, triangles: %d}",vertices.Num(),triangles.Num() / 3);
+    m_directions.SetNumUninitialized( vertices.Num() );
+    for( int32 v = 0; v < vertices.Num(); ++v )
+    {
+        m_directions[v] = vertices[v].GetSafeNormal();
+    }
+    m_neighbours.build_vertex_vertices( triangles.GetData(), triangles.Num(), vertices.Num() );
+    FScopeLock lock( &m_lock );
+    m_pool.Empty(); //sized for the old mesh
+}
+
+TUniquePtr<sphere_query::scratch> sphere_query::acquire()
+{
+    {
+        FScopeLock lock( &m_lock );
+        if( m_pool.Num() > 0 )
+        {
+            return m_pool.Pop( false );
+        }
+    }
+    TUniquePtr<scratch> buffers( new scratch() );
+    buffers->visited.AddZeroed( (m_directions.Num() + 31) / 32 );
+    return buffers;
+}
+
+void sphere_query::release( TUniquePtr<scratch> &&buffers )
+{
+    FScopeLock lock( &m_lock );
+    m_pool.Add( MoveTemp( buffers ) );
+}
+
+int32 sphere_query::nearest_vertex( const FVector &direction ) const
+{
+    if( !is_built() )
+    {
+        return INDEX_NONE;
+    }
+    //start on the best icosahedron corner, they are the first 12 vertices of any icosphere
+    const FVector target = direction.GetSafeNormal();
+    int32 best = 0;
+    float best_dot = -2.f;
+    for( int32 v = 0; v < FMath::Min( 12, m_directions.Num() ); ++v )
+    {
+        float d = FVector::DotProduct( m_directions[v], target );
+        if( d > best_dot )
+        {
+            best = v;
+            best_dot = d;
+        }
+    }
+    for( bool moved = true; moved; )
+    {
+        moved = false;
+        const int32* neighbours = m_neighbours.get( best );
+        const int32 count = m_neighbours.num( best );
+        for( int32 k = 0; k < count; ++k )
+        {
+            float d = FVector::DotProduct( m_directions[neighbours[k]], target );
+            if( d > best_dot )
+            {
+                best = neighbours[k];
+                best_dot = d;
+                moved = true;
+            }
+        }
+    }
+    return best;
+}
+
+void sphere_query::run( const vertex_query &query, vertex_query_result &result, scratch &buffers ) const
+{
+    result.vertices.Reset();
+    result.hops.Reset();
+    buffers.origins.Reset();
+    buffers.touched.Reset();
+    buffers.start.Reset();
+
+    if( query.sources.Num() == 0 )
+    {
+        buffers.origins.Add( query.centre.GetSafeNormal() );
+        buffers.start.Add( nearest_vertex( query.centre ) );
+    }
+    for( int32 source : query.sources )
+    {
+        if( m_directions.IsValidIndex( source ) )
+        {
+            buffers.origins.Add( m_directions[source] );
+            buffers.start.Add( source );
+        }
+    }
+
+    const bool limit_angle = query.max_angle < PI;
+    const float min_dot = FMath::Cos( query.max_angle );
+    auto reach = [&]( int32 v, int32 hop ){
+        uint32 &word = buffers.visited[v >> 5];
+        const uint32 bit = 1u << (v & 31);
+        if( word & bit )
+        {
+            return;
+        }
+        word |= bit;
+        buffers.touched.Add( v );
+        if( limit_angle )
+        {
+            bool inside = false;
+            for( const FVector &origin : buffers.origins )
+            {
+                if( FVector::DotProduct( m_directions[v], origin ) >= min_dot )
+                {
+                    inside = true;
+                    break;
+                }
+            }
+            if( !inside )
+            {
+                return;
+            }
+        }
+        result.vertices.Add( v );
+        result.hops.Add( hop );
+    };
+
+    for( int32 v : buffers.start )
+    {
+        reach( v, 0 );
+    }
+    //one layer per hop, the result array doubles as the queue
+    int32 head = 0;
+    for( int32 hop = 1; hop <= query.max_hops && head < result.vertices.Num(); ++hop )
+    {
+        const int32 layer_end = result.vertices.Num();
+        for( ; head < layer_end; ++head )
+        {
+            const int32 v = result.vertices[head];
+            const int32* neighbours = m_neighbours.get( v );
+            const int32 count = m_neighbours.num( v );
+            for( int32 k = 0; k < count; ++k )
+            {
+                reach( neighbours[k], hop );
+            }
+        }
+    }
+
+    for( int32 v : buffers.touched )
+    {
+        buffers.visited[v >> 5] = 0;
+    }
+}
+
+void sphere_query::query( const vertex_query &query, vertex_query_result &result )
+{
+    if( !is_built() )
+    {
+        logError(Geometry,"Vertex query has not been built.");
+        result = vertex_query_result();
+        return;
+    }
+    TUniquePtr<scratch> buffers = acquire();
+    run( query, result, *buffers );
+    release( MoveTemp( buffers ) );
+}
+
+void sphere_query::query( const TArray<vertex_query> &queries, TArray<vertex_query_result> &results )
+{
+    results.SetNum( queries.Num() );
+    if( !is_built() )
+    {
+        logError(Geometry,"Vertex query has not been built.");
+        return;
+    }
+    const int32 chunks = FMath::DivideAndRoundUp( queries.Num(), query_chunk );
+    ParallelFor( chunks, [this, &queries, &results]( int32 chunk ){
+        TUniquePtr<scratch> buffers = acquire();
+        const int32 end = FMath::Min( queries.Num(), (chunk + 1) * query_chunk );
+        for( int32 q = chunk * query_chunk; q < end; ++q )
+        {
+            run( queries[q], results[q], *buffers );
+        }
+        release( MoveTemp( buffers ) );
+    } );
+}
+
+void sphere_query::benchmark( int32 queries )
+{
+    FRandomStream stream( 42 );
+    for( uint8 level = 6; level <= 9; ++level )
+    {
+        const icosphere &base = sphere_batch::shared().get_base( level );
+        sphere_query engine;
+        engine.build( base.get_vertices(), TArray<int>( base.get_triangles_raw(), base.get_index_count() ) );
+
+        TArray<vertex_query> rings;
+        TArray<vertex_query> caps;
+        for( int32 q = 0; q < queries; ++q )
+        {
+            vertex_query ring;
+            ring.sources.Add( stream.RandHelper( engine.get_vert_count() ) );
+            ring.max_hops = 8;
+            rings.Add( ring );
+
+            vertex_query cap;
+            cap.centre = stream.GetUnitVector();
+            cap.max_angle = 0.05f;
+            caps.Add( cap );
+        }
+
+        vertex_query_result result;
+        TArray<vertex_query_result> results;
+        double start = FPlatformTime::Seconds();
+        for( const vertex_query &ring : rings )
+        {
+            engine.query( ring, result );
+        }
+        double ring_latency = (FPlatformTime::Seconds() - start) / queries;
+        start = FPlatformTime::Seconds();
+        for( const vertex_query &cap : caps )
+        {
+            engine.query( cap, result );
+        }
+        double cap_latency = (FPlatformTime::Seconds() - start) / queries;
+        start = FPlatformTime::Seconds();
+        engine.query( caps, results );
+        double batched = FPlatformTime::Seconds() - start;
+
+        logInfoC(Geometry,DColor::Cyan,true,"Vertex query benchmark level %d {vertices: %d, 8-ring: %.1f us, 0.05 rad cap: %.1f us (%d vertices), batched caps: %.0f queries/s}",
+            level,engine.get_vert_count(),ring_latency * 1e6,cap_latency * 1e6,result.vertices.Num(),batched > 0.0 ? queries / batched : 0.0);
+    }
+}
@@ -0,0 +1,67 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "adjacency.h"
+
+struct vertex_query
+{
+    // the search starts from all of these at once (hop 0). When empty, the vertex nearest to `centre` is used
+    TArray<int32> sources;
+    FVector centre = FVector::ZeroVector;
+    int32 max_hops = MAX_int32;
+    // great-circle cutoff in radians, from the closest source (or from `centre` when there are no sources)
+    float max_angle = PI;
+};
+
+struct vertex_query_result
+{
+    // in the order they were reached, hops[i] belongs to vertices[i]
+    TArray<int32> vertices;
+    TArray<int32> hops;
+};
+
+/**
+* Neighbourhood queries over sphere vertices
+*********************************************
+*
+* Breadth first searches over the mesh connectivity, stopping at a hop count, a great-circle distance, or both.
+* Each search only touches the vertices it returns (and the ring just outside them), visited bits are kept
+* in scratch buffers that are cleared by undoing the bits that were set, and handed from query to query.
+*/
+class sphere_query
+{
+private:
+    struct scratch
+    {
+        TArray<uint32> visited;
+        TArray<int32> touched;
+        TArray<int32> start;
+        TArray<FVector> origins;
+    };
+
+    TArray<FVector> m_directions;
+    mesh_adjacency m_neighbours;
+    FCriticalSection m_lock;
+    TArray<TUniquePtr<scratch>> m_pool;
+
+protected:
+    TUniquePtr<scratch> acquire();
+    void release( TUniquePtr<scratch> &&buffers );
+    void run( const vertex_query &query, vertex_query_result &result, scratch &buffers ) const;
+
+public:
+    void build( const TArray<FVector> &vertices, const TArray<int> &triangles );
+    bool is_built() const { return m_directions.Num() > 0; }
+    int32 get_vert_count() const { return m_directions.Num(); }
+
+    // walks downhill over the mesh, which on a convex triangulation always ends on the nearest vertex
+    int32 nearest_vertex( const FVector &direction ) const;
+    void query( const vertex_query &query, vertex_query_result &result );
+    // runs every query on worker threads, results[i] belongs to queries[i]
+    void query( const TArray<vertex_query> &queries, TArray<vertex_query_result> &results );
+
+    // logs per query latency for ring and distance queries on levels 6 to 9
+    static void benchmark( int32 queries = 1000 );
+};
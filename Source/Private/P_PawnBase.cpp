@@ -1,7 +1,7 @@
 // Fill out your copyright notice in the Description page of Project Settings.
 
 #include "P_PawnBase.h"
-#include "ProceduralMeshComponent.h"
+#include "StagedMeshComponent.h"
 #include "GameFramework/FloatingPawnMovement.h"
 #include "GameFramework/PawnMovementComponent.h"
 #include "GameFramework/PlayerController.h"
@@ -10,24 +10,23 @@
 #include "Engine/CollisionProfile.h"
 
 #include "Geometry/icosphere.h"
+#include "Geometry/spherebatch.h"
+#include "Geometry/spherebvh.h"
+#include "Geometry/spherequery.h"
+#include "Geometry/deltacodec.h"
+#include "Geometry/displacement.h"
 #include "core.h"
-#include <mutex>
 
 //global to file
-icosphere unitsphere;
 float epsilon = 0.000015f;
+//deformation packets stay below a typical MTU, and are not worth sending below a few runs
+const int32 max_deformation_packet = 1024;
+const int32 min_deformation_packet = 32;
 
-void construct_icosphere(){
+const icosphere& construct_icosphere(){
     static const uint8 subdivisions = 9;
-    if( unitsphere.get_vert_count() == 0 ){
-        logInfoC(Geometry,DColor::Green,true,"Generating cached icosphere [run once](in a perfect world)");
-        unitsphere.make_icosphere(subdivisions);
-    }
-    /*static std::once_flag constructed_flag;
-    std::call_once(constructed_flag, [](){ 
-        logInfoC(Geometry,DColor::Green,true,"Generating icosphere [run once]");
-        unitsphere.make_icosphere(subdivisions);
-    });*/
+    //shared with batch requests for the same level, generated the first time anybody asks
+    return sphere_batch::shared().get_base(subdivisions);
 }
 
 
@@ -63,7 +62,7 @@ AP_PawnBase::AP_PawnBase()
     MovementComponent = CreateDefaultSubobject<UPawnMovementComponent, UFloatingPawnMovement>(AP_PawnBase::MovementComponentName);
     MovementComponent->UpdatedComponent = CollisionComponent;
 
-    MeshComponent = CreateOptionalDefaultSubobject<UProceduralMeshComponent>( AP_PawnBase::MeshComponentName );
+    MeshComponent = CreateOptionalDefaultSubobject<UStagedMeshComponent>( AP_PawnBase::MeshComponentName );
     /*MeshComponent->AttachToComponent(RootComponent,FAttachmentTransformRules(EAttachmentRule::KeepRelative,true));*/
     if( MeshComponent ){
         MeshComponent->SetupAttachment(RootComponent);
@@ -108,36 +107,407 @@ bool AP_PawnBase::hasRadius(){
 
 void AP_PawnBase::ConstructSphereRunOnce(){
     if ( !hasSphereData() ) {
-        construct_icosphere();
+        const icosphere &unitsphere = construct_icosphere();
         m_triangles = TArray<int>( unitsphere.get_triangles_raw(), unitsphere.get_index_count() );
         m_normals = TArray<FVector>( unitsphere.get_vertices() );
         m_vertices = TArray<FVector>( unitsphere.get_vertices() );
         m_uvmapping = TArray<FVector2D>( unitsphere.get_uvmapping() );
+        resetDeformation();
         MakeMesh();
     }
 }
 
 void AP_PawnBase::ConstructSphere(){
-    construct_icosphere();
+    const icosphere &unitsphere = construct_icosphere();
     m_triangles = TArray<int>( unitsphere.get_triangles_raw(), unitsphere.get_index_count() );
     m_normals = TArray<FVector>( unitsphere.get_vertices() );
     m_vertices = TArray<FVector>( unitsphere.get_vertices() );
     m_uvmapping = TArray<FVector2D>( unitsphere.get_uvmapping() );
+    resetDeformation();
+    MakeMesh();
+}
+
+void AP_PawnBase::ConstructSpheres(const TArray<AP_PawnBase*> &Pawns, uint8 Subdivisions, float Radius, int32 Seed, float Deformation){
+    TArray<sphere_request> requests;
+    TArray<TWeakObjectPtr<AP_PawnBase>> targets;
+    for( AP_PawnBase* pawn : Pawns ){
+        if( !pawn ){
+            continue;
+        }
+        sphere_request request;
+        request.subdivisions = Subdivisions;
+        request.radius = Radius;
+        request.seed = Seed == 0 ? 0 : Seed + targets.Num();
+        request.deformation = Deformation;
+        requests.Add(request);
+        targets.Add(pawn);
+    }
+    //meshes are uploaded on the game thread as each sphere finishes, pawns destroyed meanwhile are skipped
+    sphere_batch::shared().submit(requests, [targets]( sphere_result &result ){
+        if( AP_PawnBase* pawn = targets[result.request].Get() ){
+            pawn->SetSphereData(result);
+        }
+    });
+}
+
+void AP_PawnBase::SetSphereData(sphere_result &result){
+    m_triangles = MoveTemp(result.triangles);
+    m_normals = MoveTemp(result.normals);
+    m_vertices = MoveTemp(result.vertices);
+    m_uvmapping = MoveTemp(result.uvmapping);
+    m_radius = result.radius;
+    resetDeformation();
     MakeMesh();
 }
 
 void AP_PawnBase::MakeMesh(){
+    if( m_dirtyflags.Num() != m_vertices.Num() ){
+        //queued vertices and craters belong to the old topology
+        resetDeformation();
+    }
     if( !MeshComponent || !hasSphereData() ) //only checking cause DefaultPawn checks a StaticMesh
     {
         logError(Geometry,"Cannot make mesh (MeshComponent is null, or SphereData is non-existant)");
         return;
     }
-    static TArray<FVector2D> dummy_uv;
-    static TArray<FColor> dummy_color;
-    static TArray<FProcMeshTangent> dummy_tangents;
-    //logWarning(Geometry,"Still using `dummy_uv` for CreateMeshSection");
-    MeshComponent->CreateMeshSection( 0, m_vertices, m_triangles, m_normals, m_uvmapping, dummy_color, dummy_tangents, true );
+    if( m_pendingCraters.Num() > 0 ){
+        //offsets from before the sphere existed go into the mesh that is about to be made
+        TArray<int32> changed;
+        for( const TPair<int32, int16> &crater : m_pendingCraters ){
+            if( m_vertices.IsValidIndex(crater.Key) ){
+                setCrater(crater.Key,crater.Value);
+                changed.Add(crater.Key);
+            }
+        }
+        logVerbose(Replication,"Applied deformation that arrived before the sphere {vertices: %d}",changed.Num());
+        m_pendingCraters.Empty();
+        if( changed.Num() > 0 ){
+            getDisplacement().smooth_normals(m_vertices,m_triangles,changed,m_normals);
+        }
+    }
+    MeshComponent->CreateMeshSection( m_vertices, m_triangles, m_normals, m_uvmapping, true );
+    m_collisionstale = false;
+    m_raytree.Reset();
     CollisionComponent->SetSphereRadius(m_radius);
+    if( m_resyncDeformation ){
+        m_resyncDeformation = false;
+        //only an owning connection can call the server, other clients rely on OnSerializeNewActor
+        if( GetNetMode() == NM_Client && GetNetConnection() ){
+            ServerResendDeformation();
+        }
+    }
+}
+
+const sphere_bvh* AP_PawnBase::getRayTree(){
+    if( !hasSphereData() ){
+        logError(Geometry,"Cannot trace, SphereData is non-existant");
+        return nullptr;
+    }
+    if( !m_raytree.IsValid() ){
+        m_raytree = MakeShareable(new sphere_bvh());
+        m_raytree->build(m_vertices,m_triangles);
+    }
+    return m_raytree->is_built() ? m_raytree.Get() : nullptr;
+}
+
+bool AP_PawnBase::TraceSphere(FVector Start, FVector End, int32 &Triangle, FVector &Barycentric, float &Distance){
+    TArray<sphere_ray> rays;
+    rays.Add({Start, (End - Start).GetSafeNormal(), (End - Start).Size()});
+    TArray<sphere_hit> hits;
+    TraceSphereRays(rays,hits);
+    if( hits.Num() == 0 || !hits[0].is_hit() ){
+        return false;
+    }
+    Triangle = hits[0].triangle;
+    Barycentric = hits[0].barycentric;
+    Distance = hits[0].distance;
+    return true;
+}
+
+void AP_PawnBase::TraceSphereRays(const TArray<sphere_ray> &rays, TArray<sphere_hit> &hits){
+    const sphere_bvh* raytree = getRayTree();
+    if( !raytree || !MeshComponent ){
+        hits.Reset();
+        hits.SetNum(rays.Num());
+        return;
+    }
+    //the tree lives in mesh space, so rays go in through the inverse transform and hits come back out
+    const FTransform &transform = MeshComponent->GetComponentTransform();
+    TArray<sphere_ray> local;
+    local.SetNumUninitialized(rays.Num());
+    for( int32 r = 0; r < rays.Num(); ++r ){
+        FVector start = transform.InverseTransformPosition(rays[r].origin);
+        FVector end = transform.InverseTransformPosition(rays[r].origin + rays[r].direction * rays[r].max_distance);
+        local[r] = {start, (end - start).GetSafeNormal(), (end - start).Size()};
+    }
+    raytree->trace(local,hits);
+    for( int32 r = 0; r < hits.Num(); ++r ){
+        if( hits[r].is_hit() ){
+            FVector point = transform.TransformPosition(local[r].origin + local[r].direction * hits[r].distance);
+            hits[r].distance = FVector::Dist(rays[r].origin, point);
+        }
+    }
+}
+
+sphere_query* AP_PawnBase::GetVertexQuery(){
+    if( !hasSphereData() ){
+        logError(Geometry,"Cannot query vertices, SphereData is non-existant");
+        return nullptr;
+    }
+    if( !m_vertexquery.IsValid() || m_vertexquery->get_vert_count() != m_vertices.Num() ){
+        m_vertexquery = MakeShareable(new sphere_query());
+        m_vertexquery->build(m_vertices,m_triangles);
+    }
+    return m_vertexquery.Get();
+}
+
+void AP_PawnBase::GetVerticesInRing(int32 Vertex, int32 Hops, TArray<int32> &Vertices){
+    Vertices.Reset();
+    sphere_query* engine = GetVertexQuery();
+    if( !engine || !m_vertices.IsValidIndex(Vertex) ){
+        return;
+    }
+    vertex_query query;
+    query.sources.Add(Vertex);
+    query.max_hops = Hops;
+    vertex_query_result result;
+    engine->query(query,result);
+    Vertices = MoveTemp(result.vertices);
+}
+
+void AP_PawnBase::GetVerticesWithin(FVector WorldPoint, float Distance, TArray<int32> &Vertices){
+    Vertices.Reset();
+    sphere_query* engine = GetVertexQuery();
+    if( !engine || !MeshComponent ){
+        return;
+    }
+    vertex_query query;
+    query.centre = MeshComponent->GetComponentTransform().InverseTransformPosition(WorldPoint);
+    query.max_angle = Distance / (FMath::IsNearlyZero(m_radius) ? 1.f : m_radius);
+    vertex_query_result result;
+    engine->query(query,result);
+    Vertices = MoveTemp(result.vertices);
+}
+
+float AP_PawnBase::baseRadius() const{
+    //a radius of zero means SetRadius was never called, the vertices are still on the unit sphere
+    return FMath::IsNearlyZero(m_radius) ? 1.f : m_radius;
+}
+
+int16 AP_PawnBase::quantizeOffset(float offset) const{
+    return (int16)FMath::Clamp(FMath::RoundToInt(offset / (baseRadius() * DeformationPrecision)), -32768, 32767);
+}
+
+float AP_PawnBase::dequantizeOffset(int16 offset) const{
+    return offset * baseRadius() * DeformationPrecision;
+}
+
+void AP_PawnBase::markDirty(int32 vertex){
+    if( m_dirtyflags.Num() != m_vertices.Num() ){
+        m_dirtyflags.Init(false,m_vertices.Num());
+        m_dirty.Reset();
+    }
+    if( !m_dirtyflags[vertex] ){
+        m_dirtyflags[vertex] = true;
+        m_dirty.Add(vertex);
+    }
+}
+
+void AP_PawnBase::resetDeformation(){
+    m_dirty.Reset();
+    m_dirtyflags.Init(false,m_vertices.Num());
+    m_craters.Reset();
+    m_resyncDeformation = !HasAuthority();
+}
+
+float AP_PawnBase::terrainHeight(int32 vertex) const{
+    //what displacement put under the vertex, its height without the crater
+    const int16* crater = m_craters.Find(vertex);
+    return m_vertices[vertex].Size() - baseRadius() - (crater ? dequantizeOffset(*crater) : 0.f);
+}
+
+void AP_PawnBase::setCrater(int32 vertex, int16 offset){
+    const float radius = baseRadius();
+    const float terrain = terrainHeight(vertex);
+    m_craters.Add(vertex,offset);
+    m_vertices[vertex] = m_vertices[vertex].GetSafeNormal() * FMath::Max(radius + terrain + dequantizeOffset(offset), radius * DeformationPrecision);
+}
+
+void AP_PawnBase::queueAllCraters(){
+    //offsets are absolute, so sending one again is harmless to clients that already have it
+    for( const TPair<int32, int16> &crater : m_craters ){
+        markDirty(crater.Key);
+    }
+    logVerbose(Replication,"Queued every crater again {craters: %d, queued: %d}",m_craters.Num(),m_dirty.Num());
+}
+
+displacement& AP_PawnBase::getDisplacement(){
+    if( !m_displacement.IsValid() ){
+        m_displacement = MakeShareable(new displacement());
+    }
+    return *m_displacement;
+}
+
+void AP_PawnBase::updateVertices(const TArray<int32> &changed){
+    if( !MeshComponent ){
+        return;
+    }
+    //the topology is unchanged, so only the changed vertices and their one-ring (whose normals move with them)
+    //are sent to the mesh's GPU buffers
+    TArray<int32> touched(changed);
+    getDisplacement().smooth_normals( m_vertices, m_triangles, touched, m_normals );
+    MeshComponent->UpdateVertices( touched, m_vertices, m_normals );
+    m_collisionstale = true;
+    if( m_raytree.IsValid() ){
+        m_raytree->refit(m_vertices,changed);
+    }
+}
+
+void AP_PawnBase::AddCrater(FVector WorldPoint, float CraterRadius, float Depth){
+    if( !HasAuthority() ){
+        logWarning(Replication,"Craters are made on the server, ignoring request.");
+        return;
+    }
+    sphere_query* engine = GetVertexQuery();
+    if( !engine || !MeshComponent || CraterRadius <= 0.f ){
+        return;
+    }
+    const float radius = baseRadius();
+    vertex_query query;
+    query.centre = MeshComponent->GetComponentTransform().InverseTransformPosition(WorldPoint).GetSafeNormal();
+    query.max_angle = CraterRadius / radius;
+    vertex_query_result result;
+    engine->query(query,result);
+
+    for( int32 v : result.vertices ){
+        FVector direction = m_vertices[v].GetSafeNormal();
+        float t = FMath::Acos(FMath::Clamp(FVector::DotProduct(direction,query.centre),-1.f,1.f)) / query.max_angle;
+        float offset = m_vertices[v].Size() - radius - terrainHeight(v) - Depth * (1.f - t * t);
+        //snapped exactly like the clients will snap it, so everybody ends up with the same mesh
+        setCrater(v,quantizeOffset(offset));
+        markDirty(v);
+    }
+    logVerbose(Replication,"Crater {vertices: %d, queued: %d}",result.vertices.Num(),m_dirty.Num());
+    updateVertices(result.vertices);
+}
+
+void AP_PawnBase::DisplaceByHeightmap(const TArray<float> &Heights, int32 Width, int32 Height, float Scale){
+    heightmap_source source(Heights,Width,Height);
+    if( !source.is_valid() ){
+        logError(Geometry,"Heightmap has %d texels, expected %d x %d.",Heights.Num(),Width,Height);
+        return;
+    }
+    Displace(source,Scale);
+}
+
+void AP_PawnBase::DisplaceByNoise(int32 Seed, int32 Octaves, float Frequency, float Scale){
+    fbm_source source(Seed,Octaves,Frequency);
+    Displace(source,Scale);
+}
+
+void AP_PawnBase::Displace(const height_source &source, float Scale){
+    if( !hasSphereData() ){
+        logError(Geometry,"Cannot displace, SphereData is non-existant");
+        return;
+    }
+    const float radius = baseRadius();
+    getDisplacement().displace(source,radius,radius * Scale,m_triangles,m_vertices,m_normals);
+    //the new terrain replaced the craters too, put them back on top of it
+    TArray<int32> cratered;
+    cratered.Reserve(m_craters.Num());
+    for( const TPair<int32, int16> &crater : m_craters ){
+        FVector &vertex = m_vertices[crater.Key];
+        vertex = vertex.GetSafeNormal() * FMath::Max(vertex.Size() + dequantizeOffset(crater.Value), radius * DeformationPrecision);
+        cratered.Add(crater.Key);
+    }
+    if( cratered.Num() > 0 ){
+        getDisplacement().smooth_normals(m_vertices,m_triangles,cratered,m_normals);
+    }
+    MakeMesh();
+}
+
+void AP_PawnBase::sendDeformation(float DeltaTime){
+    m_netclock += DeltaTime;
+    m_netstatclock += DeltaTime;
+    m_netbudget = FMath::Min(m_netbudget + DeltaTime * DeformationBandwidth, (float)DeformationBandwidth);
+    if( m_netstatclock >= 1.f ){
+        if( m_netbytes > 0 ){
+            logInfo(Replication,"Deformation replication {bytes/s: %.0f, queued vertices: %d}",m_netbytes / m_netstatclock,m_dirty.Num());
+        }
+        m_netbytes = 0;
+        m_netstatclock = 0.f;
+    }
+
+    //at most one packet per net update, as large as the budget allows
+    const int32 budget = FMath::Min((int32)m_netbudget, max_deformation_packet);
+    if( m_dirty.Num() == 0 || m_netclock < 1.f / NetUpdateFrequency || budget < min_deformation_packet ){
+        return;
+    }
+    m_netclock = 0.f;
+    m_dirty.Sort();
+    TArray<int16> offsets;
+    offsets.SetNumUninitialized(m_dirty.Num());
+    for( int32 i = 0; i < m_dirty.Num(); ++i ){
+        offsets[i] = m_craters.FindRef(m_dirty[i]);
+    }
+
+    TArray<uint8> packet;
+    int32 sent = deformation_codec::encode(m_dirty.GetData(), offsets.GetData(), m_dirty.Num(), budget, packet);
+    for( int32 i = 0; i < sent; ++i ){
+        m_dirtyflags[m_dirty[i]] = false;
+    }
+    m_dirty.RemoveAt(0,sent,false);
+    m_netbudget -= packet.Num();
+    m_netbytes += packet.Num();
+    MulticastDeformation(packet);
+}
+
+void AP_PawnBase::MulticastDeformation_Implementation(const TArray<uint8> &Packet){
+    if( HasAuthority() ){
+        return; //the edits came from here
+    }
+    TArray<int32> vertices;
+    TArray<int16> offsets;
+    deformation_codec::decode(Packet,vertices,offsets);
+    if( !hasSphereData() ){
+        //kept by vertex rather than by packet, so a client waiting on its sphere holds at most one offset per vertex
+        for( int32 i = 0; i < vertices.Num(); ++i ){
+            m_pendingCraters.Add(vertices[i],offsets[i]);
+        }
+        logVerbose(Replication,"Deformation arrived before the sphere, keeping it for MakeMesh {bytes: %d, waiting: %d}",Packet.Num(),m_pendingCraters.Num());
+        return;
+    }
+    TArray<int32> changed;
+    changed.Reserve(vertices.Num());
+    for( int32 i = 0; i < vertices.Num(); ++i ){
+        if( !m_vertices.IsValidIndex(vertices[i]) ){
+            continue;
+        }
+        setCrater(vertices[i],offsets[i]);
+        changed.Add(vertices[i]);
+    }
+    logVerbose(Replication,"Applied deformation {bytes: %d, vertices: %d}",Packet.Num(),changed.Num());
+    updateVertices(changed);
+}
+
+void AP_PawnBase::ServerResendDeformation_Implementation(){
+    queueAllCraters();
+}
+
+void AP_PawnBase::OnSerializeNewActor(FOutBunch &OutBunch){
+    Super::OnSerializeNewActor(OutBunch);
+    //the new client missed every packet so far, it gets them again with everybody else's next packets
+    if( HasAuthority() && m_craters.Num() > 0 ){
+        queueAllCraters();
+    }
+}
+
+bool AP_PawnBase::StageMesh(TFunction<void(FProcMeshSection &section)> Fill){
+    if( !MeshComponent || !hasSphereData() ){
+        logError(Geometry,"Cannot stage mesh (MeshComponent is null, or SphereData is non-existant)");
+        return false;
+    }
+    return MeshComponent->Stage(MoveTemp(Fill));
 }
 
 void AP_PawnBase::SetRadius(float radius){
@@ -150,7 +520,7 @@ void AP_PawnBase::SetRadius(float radius){
     float factor;
     if( FMath::IsNearlyZero(m_radius) )
     {
-        m_vertices = TArray<FVector>( m_normals );
+        //still the unit sphere (or displaced around it), normals are not copied back since they may be smooth normals now
         m_radius = 1.f;
         factor = radius;
     }
@@ -185,6 +555,19 @@ void AP_PawnBase::SetMaterial(UMaterialInterface* material){
 void AP_PawnBase::Tick(float DeltaTime)
 {
     Super::Tick(DeltaTime);
+    if( MeshComponent ){
+        MeshComponent->PresentStaged();
+        //cooking is too slow to follow every edit, batches of edits are cooked together on a worker
+        m_collisionclock += DeltaTime;
+        if( m_collisionstale && m_collisionclock >= CollisionRefreshInterval ){
+            MeshComponent->UpdateCollision();
+            m_collisionstale = false;
+            m_collisionclock = 0.f;
+        }
+    }
+    if( HasAuthority() ){
+        sendDeformation(DeltaTime);
+    }
 }
 
 // Called to bind functionality to input
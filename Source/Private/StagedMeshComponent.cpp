@@ -0,0 +1,496 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "StagedMeshComponent.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "DynamicMeshBuilder.h"
+#include "Engine/Engine.h"
+#include "LocalVertexFactory.h"
+#include "MaterialShared.h"
+#include "Materials/Material.h"
+#include "PhysicsEngine/BodySetup.h"
+#include "PrimitiveSceneProxy.h"
+#include "PrimitiveViewRelevance.h"
+#include "RenderingThread.h"
+#include "SceneManagement.h"
+#include "StaticMeshResources.h"
+
+#include "Geometry/meshstaging.h"
+#include "core.h"
+
+
+//edits closer than this many vertices share a run, the unchanged vertices between them are uploaded along
+static const int32 upload_run_gap = 16;
+//locks per buffer for one update, the narrowest gaps are bridged until the runs fit
+static const int32 max_upload_runs = 32;
+
+struct upload_run
+{
+    int32 first;
+    int32 count;
+};
+
+//sparse edits, copied out of the pawn's arrays on the game thread and written into the proxy on the render thread
+struct staged_vertex_update
+{
+    TArray<int32> indices; //sorted
+    TArray<FVector> positions;
+    TArray<FVector> normals;
+    TArray<upload_run> runs;
+};
+
+//subdivision appends every level's vertices to the end, so the neighbours of an edit are spread across the whole
+//buffer. A single range around them would be most of the mesh, runs only cover the clusters the edit touches
+static void plan_upload_runs( const TArray<int32> &sorted, TArray<upload_run> &runs ){
+    runs.Reset();
+    for( int32 v : sorted ){
+        if( runs.Num() > 0 && v - (runs.Last().first + runs.Last().count) <= upload_run_gap ){
+            runs.Last().count = v - runs.Last().first + 1;
+        }
+        else{
+            runs.Add({v, 1});
+        }
+    }
+    if( runs.Num() <= max_upload_runs ){
+        return;
+    }
+    //keep the widest gaps as the splits between runs, ties go to the earlier gaps
+    TArray<int32> gaps;
+    gaps.SetNumUninitialized(runs.Num() - 1);
+    for( int32 r = 1; r < runs.Num(); ++r ){
+        gaps[r - 1] = runs[r].first - (runs[r - 1].first + runs[r - 1].count);
+    }
+    TArray<int32> widest(gaps);
+    widest.Sort(TGreater<int32>());
+    const int32 threshold = widest[max_upload_runs - 2];
+    int32 ties = max_upload_runs - 1;
+    for( int32 gap : gaps ){
+        ties -= gap > threshold ? 1 : 0;
+    }
+    TArray<upload_run> merged;
+    merged.Add(runs[0]);
+    for( int32 r = 1; r < runs.Num(); ++r ){
+        const int32 gap = gaps[r - 1];
+        if( gap > threshold || (gap == threshold && ties-- > 0) ){
+            merged.Add(runs[r]);
+        }
+        else{
+            merged.Last().count = runs[r].first + runs[r].count - merged.Last().first;
+        }
+    }
+    runs = MoveTemp(merged);
+}
+
+static FVector tangent_for( const FVector &normal ){
+    //east, which is what the sphere's uvs follow. Any vector across the normal works at the poles
+    FVector east( -normal.Y, normal.X, 0.f );
+    return east.Normalize() ? east : FVector( 1.f, 0.f, 0.f );
+}
+
+static FDynamicMeshVertex dynamic_vertex( const FVector &position, const FVector &tangent, const FVector &normal, const FVector2D &uv ){
+    return FDynamicMeshVertex( position, tangent, normal, uv, FColor::White );
+}
+
+/**
+ * Proxy for UStagedMeshComponent. Built once per CreateMeshSection (or whenever the engine recreates render state),
+ * then only ever patched: the render thread rewrites positions and tangents in place and uploads the runs that changed.
+ */
+class FStagedMeshSceneProxy final : public FPrimitiveSceneProxy
+{
+private:
+    FStaticMeshVertexBuffers VertexBuffers;
+    FDynamicMeshIndexBuffer32 IndexBuffer;
+    FLocalVertexFactory VertexFactory;
+    UMaterialInterface* Material;
+    FMaterialRelevance MaterialRelevance;
+
+    void writeVertex(int32 index, const FVector &position, const FVector &tangent, const FVector &normal){
+        FDynamicMeshVertex vertex = dynamic_vertex(position, tangent, normal, FVector2D::ZeroVector);
+        VertexBuffers.PositionVertexBuffer.VertexPosition(index) = position;
+        VertexBuffers.StaticMeshVertexBuffer.SetVertexTangents(index, vertex.TangentX.ToFVector(), vertex.GetTangentY(), vertex.TangentZ.ToFVector());
+    }
+
+    // copies vertices [first, first + count) from the CPU side of the buffers to the GPU
+    void upload(int32 first, int32 count){
+        FPositionVertexBuffer &positions = VertexBuffers.PositionVertexBuffer;
+        const uint32 stride = positions.GetStride();
+        void* data = RHILockVertexBuffer(positions.VertexBufferRHI, first * stride, count * stride, RLM_WriteOnly);
+        FMemory::Memcpy(data, (uint8*)positions.GetVertexData() + first * stride, count * stride);
+        RHIUnlockVertexBuffer(positions.VertexBufferRHI);
+
+        FStaticMeshVertexBuffer &tangents = VertexBuffers.StaticMeshVertexBuffer;
+        const uint32 tangent_stride = tangents.GetTangentSize() / tangents.GetNumVertices();
+        data = RHILockVertexBuffer(tangents.TangentsVertexBuffer.VertexBufferRHI, first * tangent_stride, count * tangent_stride, RLM_WriteOnly);
+        FMemory::Memcpy(data, (uint8*)tangents.GetTangentData() + first * tangent_stride, count * tangent_stride);
+        RHIUnlockVertexBuffer(tangents.TangentsVertexBuffer.VertexBufferRHI);
+    }
+
+public:
+    FStagedMeshSceneProxy(UStagedMeshComponent* Component, const FProcMeshSection &Section)
+        : FPrimitiveSceneProxy(Component)
+        , VertexFactory(GetScene().GetFeatureLevel(), "FStagedMeshSceneProxy")
+        , MaterialRelevance(Component->GetMaterialRelevance(GetScene().GetFeatureLevel()))
+    {
+        TArray<FDynamicMeshVertex> vertices;
+        vertices.SetNumUninitialized(Section.ProcVertexBuffer.Num());
+        for( int32 v = 0; v < vertices.Num(); ++v ){
+            const FProcMeshVertex &source = Section.ProcVertexBuffer[v];
+            vertices[v] = dynamic_vertex(source.Position, source.Tangent.TangentX, source.Normal, source.UV0);
+        }
+        IndexBuffer.Indices = Section.ProcIndexBuffer;
+        VertexBuffers.InitFromDynamicVertex(&VertexFactory, vertices);
+
+        BeginInitResource(&VertexBuffers.PositionVertexBuffer);
+        BeginInitResource(&VertexBuffers.StaticMeshVertexBuffer);
+        BeginInitResource(&VertexBuffers.ColorVertexBuffer);
+        BeginInitResource(&IndexBuffer);
+        BeginInitResource(&VertexFactory);
+
+        Material = Component->GetMaterial(0);
+        if( !Material ){
+            Material = UMaterial::GetDefaultMaterial(MD_Surface);
+        }
+    }
+
+    virtual ~FStagedMeshSceneProxy(){
+        VertexBuffers.PositionVertexBuffer.ReleaseResource();
+        VertexBuffers.StaticMeshVertexBuffer.ReleaseResource();
+        VertexBuffers.ColorVertexBuffer.ReleaseResource();
+        IndexBuffer.ReleaseResource();
+        VertexFactory.ReleaseResource();
+    }
+
+    // every vertex of a presented buffer
+    void UpdateSection_RenderThread(const FProcMeshSection &Section){
+        check(IsInRenderingThread());
+        const int32 count = FMath::Min(Section.ProcVertexBuffer.Num(), (int32)VertexBuffers.PositionVertexBuffer.GetNumVertices());
+        for( int32 v = 0; v < count; ++v ){
+            const FProcMeshVertex &source = Section.ProcVertexBuffer[v];
+            writeVertex(v, source.Position, source.Tangent.TangentX, source.Normal);
+        }
+        if( count > 0 ){
+            upload(0, count);
+        }
+    }
+
+    // only the vertices in the update, uploading the runs that cover them
+    void UpdateVertices_RenderThread(const staged_vertex_update &Update){
+        check(IsInRenderingThread());
+        const int32 vert_count = VertexBuffers.PositionVertexBuffer.GetNumVertices();
+        if( Update.indices.Num() == 0 || Update.indices.Last() >= vert_count ){
+            return;
+        }
+        for( int32 i = 0; i < Update.indices.Num(); ++i ){
+            writeVertex(Update.indices[i], Update.positions[i], tangent_for(Update.normals[i]), Update.normals[i]);
+        }
+        for( const upload_run &run : Update.runs ){
+            upload(run.first, run.count);
+        }
+    }
+
+    virtual SIZE_T GetTypeHash() const override{
+        static size_t UniquePointer;
+        return reinterpret_cast<size_t>(&UniquePointer);
+    }
+
+    virtual void GetDynamicMeshElements(const TArray<const FSceneView*> &Views, const FSceneViewFamily &ViewFamily, uint32 VisibilityMap, FMeshElementCollector &Collector) const override{
+        const bool bWireframe = AllowDebugViewmodes() && ViewFamily.EngineShowFlags.Wireframe;
+        FMaterialRenderProxy* MaterialProxy = Material->GetRenderProxy();
+        if( bWireframe ){
+            FColoredMaterialRenderProxy* WireframeMaterialInstance = new FColoredMaterialRenderProxy(
+                GEngine->WireframeMaterial ? GEngine->WireframeMaterial->GetRenderProxy() : nullptr,
+                FLinearColor(0, 0.5f, 1.f));
+            Collector.RegisterOneFrameMaterialProxy(WireframeMaterialInstance);
+            MaterialProxy = WireframeMaterialInstance;
+        }
+
+        for( int32 ViewIndex = 0; ViewIndex < Views.Num(); ViewIndex++ ){
+            if( !(VisibilityMap & (1 << ViewIndex)) ){
+                continue;
+            }
+            FMeshBatch &Mesh = Collector.AllocateMesh();
+            FMeshBatchElement &BatchElement = Mesh.Elements[0];
+            BatchElement.IndexBuffer = &IndexBuffer;
+            Mesh.bWireframe = bWireframe;
+            Mesh.VertexFactory = &VertexFactory;
+            Mesh.MaterialRenderProxy = MaterialProxy;
+
+            bool bHasPrecomputedVolumetricLightmap;
+            FMatrix PreviousLocalToWorld;
+            int32 SingleCaptureIndex;
+            bool bOutputVelocity;
+            GetScene().GetPrimitiveUniformShaderParameters_RenderThread(GetPrimitiveSceneInfo(), bHasPrecomputedVolumetricLightmap, PreviousLocalToWorld, SingleCaptureIndex, bOutputVelocity);
+
+            FDynamicPrimitiveUniformBuffer &DynamicPrimitiveUniformBuffer = Collector.AllocateOneFrameResource<FDynamicPrimitiveUniformBuffer>();
+            DynamicPrimitiveUniformBuffer.Set(GetLocalToWorld(), PreviousLocalToWorld, GetBounds(), GetLocalBounds(), true, bHasPrecomputedVolumetricLightmap, DrawsVelocity(), bOutputVelocity);
+            BatchElement.PrimitiveUniformBufferResource = &DynamicPrimitiveUniformBuffer.UniformBuffer;
+
+            BatchElement.FirstIndex = 0;
+            BatchElement.NumPrimitives = IndexBuffer.Indices.Num() / 3;
+            BatchElement.MinVertexIndex = 0;
+            BatchElement.MaxVertexIndex = VertexBuffers.PositionVertexBuffer.GetNumVertices() - 1;
+            Mesh.ReverseCulling = IsLocalToWorldDeterminantNegative();
+            Mesh.Type = PT_TriangleList;
+            Mesh.DepthPriorityGroup = SDPG_World;
+            Mesh.bCanApplyViewModeDecals = false;
+            Collector.AddMesh(ViewIndex, Mesh);
+        }
+    }
+
+    virtual FPrimitiveViewRelevance GetViewRelevance(const FSceneView* View) const override{
+        FPrimitiveViewRelevance Result;
+        Result.bDrawRelevance = IsShown(View);
+        Result.bShadowRelevance = IsShadowCast(View);
+        Result.bDynamicRelevance = true;
+        Result.bRenderInMainPass = ShouldRenderInMainPass();
+        Result.bUsesLightingChannels = GetLightingChannelMask() != GetDefaultLightingChannelMask();
+        Result.bRenderCustomDepth = ShouldRenderCustomDepth();
+        MaterialRelevance.SetPrimitiveViewRelevance(Result);
+        Result.bVelocityRelevance = IsMovable() && Result.bOpaque && Result.bRenderInMainPass;
+        return Result;
+    }
+
+    virtual bool CanBeOccluded() const override{
+        return !MaterialRelevance.bDisableDepthTest;
+    }
+
+    virtual uint32 GetMemoryFootprint() const override{
+        return sizeof(*this) + GetAllocatedSize();
+    }
+};
+
+
+void UStagedMeshComponent::CreateMeshSection(const TArray<FVector> &Vertices, const TArray<int32> &Triangles, const TArray<FVector> &Normals, const TArray<FVector2D> &UV0, bool bCreateCollision){
+    //a new section rather than an edit of the old one, which a render command may still be reading
+    shared_section section = MakeShareable(new FProcMeshSection());
+    section->ProcVertexBuffer.SetNum(Vertices.Num());
+    for( int32 v = 0; v < Vertices.Num(); ++v ){
+        FProcMeshVertex &vertex = section->ProcVertexBuffer[v];
+        vertex.Position = Vertices[v];
+        vertex.Normal = Normals.IsValidIndex(v) ? Normals[v] : Vertices[v].GetSafeNormal();
+        vertex.Tangent = FProcMeshTangent(tangent_for(vertex.Normal), false);
+        vertex.UV0 = UV0.IsValidIndex(v) ? UV0[v] : FVector2D::ZeroVector;
+        section->SectionLocalBox += vertex.Position;
+    }
+    section->ProcIndexBuffer.SetNumUninitialized(Triangles.Num());
+    for( int32 i = 0; i < Triangles.Num(); ++i ){
+        section->ProcIndexBuffer[i] = FMath::Clamp(Triangles[i], 0, Vertices.Num() - 1);
+    }
+    section->bEnableCollision = bCreateCollision;
+    m_section = section;
+    //back buffers were copies of the old section, in-flight fills keep the old staging alive until they finish
+    m_staging.Reset();
+
+    UpdateBounds();
+    MarkRenderStateDirty();
+    //a cook that started before this has the old section's shape, finishCollision drops it
+    CookingBodySetup = nullptr;
+    m_collisionstale = false;
+    if( bCreateCollision ){
+        updateCollision();
+    }
+}
+
+void UStagedMeshComponent::UpdateVertices(const TArray<int32> &Changed, const TArray<FVector> &Vertices, const TArray<FVector> &Normals){
+    if( !m_section.IsValid() || Changed.Num() == 0 ){
+        return;
+    }
+    if( !m_section.IsUnique() ){
+        //a present from this frame is still to be uploaded from this section, edit a copy. Only happens when Stage and
+        //UpdateVertices are both used in the same frame
+        m_section = MakeShareable(new FProcMeshSection(*m_section));
+    }
+    TArray<int32> sorted(Changed);
+    sorted.Sort();
+    TSharedRef<staged_vertex_update, ESPMode::ThreadSafe> update = MakeShareable(new staged_vertex_update());
+    update->indices.Reserve(sorted.Num());
+    update->positions.Reserve(sorted.Num());
+    update->normals.Reserve(sorted.Num());
+    for( int32 v : sorted ){
+        if( !m_section->ProcVertexBuffer.IsValidIndex(v) || !Vertices.IsValidIndex(v) || !Normals.IsValidIndex(v) ){
+            continue;
+        }
+        if( update->indices.Num() > 0 && update->indices.Last() == v ){
+            continue;
+        }
+        FProcMeshVertex &vertex = m_section->ProcVertexBuffer[v];
+        vertex.Position = Vertices[v];
+        vertex.Normal = Normals[v];
+        vertex.Tangent = FProcMeshTangent(tangent_for(vertex.Normal), false);
+        //grows only, a tight box would need every vertex
+        m_section->SectionLocalBox += vertex.Position;
+        update->indices.Add(v);
+        update->positions.Add(vertex.Position);
+        update->normals.Add(vertex.Normal);
+    }
+    if( update->indices.Num() == 0 ){
+        return;
+    }
+    plan_upload_runs(update->indices, update->runs);
+
+    if( SceneProxy && !IsRenderStateDirty() ){
+        FStagedMeshSceneProxy* proxy = static_cast<FStagedMeshSceneProxy*>(SceneProxy);
+        ENQUEUE_RENDER_COMMAND(StagedMeshUpdateVertices)( [proxy, update](FRHICommandListImmediate &RHICmdList){
+            proxy->UpdateVertices_RenderThread(*update);
+        } );
+    }
+    UpdateBounds();
+    MarkRenderTransformDirty();
+}
+
+bool UStagedMeshComponent::Stage(fill_function fill){
+    if( !m_section.IsValid() || m_section->ProcVertexBuffer.Num() == 0 ){
+        logError(Geometry,"Cannot stage, the mesh section has to be created first.");
+        return false;
+    }
+    if( !m_staging.IsValid() || m_staging->get_vert_count() != m_section->ProcVertexBuffer.Num() ){
+        //buffers still out with workers keep the old staging alive until they finish
+        m_staging = MakeShareable(new mesh_staging(*m_section, FMath::Max(1,StagingBuffers)));
+    }
+
+    mesh_staging::buffer back = m_staging->acquire();
+    if( !back.IsValid() ){
+        logVerbose(Geometry,"Every staging buffer is busy, skipping this frame.");
+        return false;
+    }
+    TSharedPtr<mesh_staging, ESPMode::ThreadSafe> staging = m_staging;
+    FFunctionGraphTask::CreateAndDispatchWhenReady( [staging, back, fill]() mutable {
+        fill(*back);
+        FBox box(ForceInit);
+        for( const FProcMeshVertex &vertex : back->ProcVertexBuffer ){
+            box += vertex.Position;
+        }
+        back->SectionLocalBox = box;
+        staging->publish(MoveTemp(back));
+    } );
+    return true;
+}
+
+bool UStagedMeshComponent::PresentStaged(){
+    if( !m_staging.IsValid() ){
+        return false;
+    }
+    mesh_staging::buffer ready = m_staging->take_ready();
+    if( !ready.IsValid() ){
+        return false;
+    }
+    if( !m_section.IsValid() || m_section->ProcVertexBuffer.Num() != ready->ProcVertexBuffer.Num() ){
+        logWarning(Geometry,"The mesh section changed shape while a frame was staged, dropping it.");
+        m_staging->recycle(MoveTemp(ready));
+        return false;
+    }
+
+    //the staged buffer becomes the section and the render thread uploads straight from it. The previous section goes
+    //back to the pool only after that command ran, since an earlier present may still be reading it
+    shared_section previous = MoveTemp(m_section);
+    m_section = ready;
+    FStagedMeshSceneProxy* proxy = SceneProxy && !IsRenderStateDirty() ? static_cast<FStagedMeshSceneProxy*>(SceneProxy) : nullptr;
+    TSharedPtr<mesh_staging, ESPMode::ThreadSafe> staging = m_staging;
+    ENQUEUE_RENDER_COMMAND(StagedMeshPresent)( [proxy, ready, previous, staging](FRHICommandListImmediate &RHICmdList) mutable {
+        if( proxy ){
+            proxy->UpdateSection_RenderThread(*ready);
+        }
+        staging->recycle(MoveTemp(previous));
+    } );
+    UpdateBounds();
+    MarkRenderTransformDirty();
+    return true;
+}
+
+FPrimitiveSceneProxy* UStagedMeshComponent::CreateSceneProxy(){
+    if( !m_section.IsValid() || m_section->ProcVertexBuffer.Num() == 0 || m_section->ProcIndexBuffer.Num() == 0 ){
+        return nullptr;
+    }
+    return new FStagedMeshSceneProxy(this, *m_section);
+}
+
+FBoxSphereBounds UStagedMeshComponent::CalcBounds(const FTransform &LocalToWorld) const{
+    if( !m_section.IsValid() || !m_section->SectionLocalBox.IsValid ){
+        return FBoxSphereBounds(LocalToWorld.GetLocation(), FVector::ZeroVector, 0.f);
+    }
+    return FBoxSphereBounds(m_section->SectionLocalBox).TransformBy(LocalToWorld);
+}
+
+UBodySetup* UStagedMeshComponent::createBodySetup(){
+    UBodySetup* body = NewObject<UBodySetup>(this, NAME_None, IsTemplate() ? RF_Public | RF_ArchetypeObject : RF_NoFlags);
+    body->BodySetupGuid = FGuid::NewGuid();
+    body->bGenerateMirroredCollision = false;
+    body->bDoubleSidedGeometry = true;
+    body->CollisionTraceFlag = CTF_UseComplexAsSimple;
+    return body;
+}
+
+void UStagedMeshComponent::updateCollision(){
+    if( !MeshBodySetup ){
+        MeshBodySetup = createBodySetup();
+    }
+    MeshBodySetup->BodySetupGuid = FGuid::NewGuid();
+    MeshBodySetup->bHasCookedCollisionData = true;
+    MeshBodySetup->InvalidatePhysicsData();
+    MeshBodySetup->CreatePhysicsMeshes();
+    RecreatePhysicsState();
+}
+
+void UStagedMeshComponent::UpdateCollision(){
+    if( !MeshBodySetup || !ContainsPhysicsTriMeshData(true) ){
+        return;
+    }
+    if( CookingBodySetup ){
+        m_collisionstale = true;
+        return;
+    }
+    //the triangles are read here on the game thread, only the cooking runs on the worker
+    CookingBodySetup = createBodySetup();
+    CookingBodySetup->CreatePhysicsMeshesAsync(FOnAsyncPhysicsCookFinished::CreateUObject(this, &UStagedMeshComponent::finishCollision, CookingBodySetup));
+}
+
+void UStagedMeshComponent::finishCollision(bool bSuccess, UBodySetup* body){
+    if( body != CookingBodySetup ){
+        return;
+    }
+    CookingBodySetup = nullptr;
+    if( bSuccess ){
+        MeshBodySetup = body;
+        RecreatePhysicsState();
+    }
+    else{
+        logWarning(Geometry,"Collision cook failed, keeping the previous collision.");
+    }
+    if( m_collisionstale ){
+        m_collisionstale = false;
+        UpdateCollision();
+    }
+}
+
+UBodySetup* UStagedMeshComponent::GetBodySetup(){
+    return MeshBodySetup;
+}
+
+bool UStagedMeshComponent::GetPhysicsTriMeshData(FTriMeshCollisionData* CollisionData, bool InUseAllTriData){
+    if( !ContainsPhysicsTriMeshData(InUseAllTriData) ){
+        return false;
+    }
+    const FProcMeshSection &section = *m_section;
+    CollisionData->Vertices.Reserve(section.ProcVertexBuffer.Num());
+    for( const FProcMeshVertex &vertex : section.ProcVertexBuffer ){
+        CollisionData->Vertices.Add(vertex.Position);
+    }
+    const int32 tri_count = section.ProcIndexBuffer.Num() / 3;
+    CollisionData->Indices.Reserve(tri_count);
+    CollisionData->MaterialIndices.Reserve(tri_count);
+    for( int32 t = 0; t < tri_count; ++t ){
+        FTriIndices triangle;
+        triangle.v0 = section.ProcIndexBuffer[3 * t];
+        triangle.v1 = section.ProcIndexBuffer[3 * t + 1];
+        triangle.v2 = section.ProcIndexBuffer[3 * t + 2];
+        CollisionData->Indices.Add(triangle);
+        CollisionData->MaterialIndices.Add(0);
+    }
+    CollisionData->bFlipNormals = true;
+    CollisionData->bDeformableMesh = true;
+    CollisionData->bFastCook = true;
+    return true;
+}
+
+bool UStagedMeshComponent::ContainsPhysicsTriMeshData(bool InUseAllTriData) const{
+    return m_section.IsValid() && m_section->bEnableCollision && m_section->ProcIndexBuffer.Num() >= 3;
+}
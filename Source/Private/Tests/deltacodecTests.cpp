@@ -0,0 +1,88 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "Geometry/deltacodec.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+//runs, single vertex runs, gaps that need several varint bytes, and the extremes of int16
+static const int32 test_vertices[] = { 0, 1, 2, 3, 4, 10, 12, 13, 70000, 70001, 70002, 2000000 };
+static const int16 test_offsets[] = { 0, 5, -5, 32767, -32768, 1, -1, 300, -300, 0, 64, -7 };
+static const int32 test_count = ARRAY_COUNT( test_vertices );
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST( FDeformationCodecRoundTripTest, "Project.Geometry.DeformationCodec.RoundTrip", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter )
+bool FDeformationCodecRoundTripTest::RunTest( const FString &Parameters )
+{
+    TArray<uint8> packet;
+    const int32 sent = deformation_codec::encode( test_vertices, test_offsets, test_count, 1024, packet );
+    TestEqual( TEXT("Every vertex fits in a large budget"), sent, test_count );
+
+    TArray<int32> vertices;
+    TArray<int16> offsets;
+    TestTrue( TEXT("Packet decodes"), deformation_codec::decode( packet, vertices, offsets ) );
+    TestTrue( TEXT("Vertices survive"), vertices == TArray<int32>( test_vertices, test_count ) );
+    TestTrue( TEXT("Offsets survive"), offsets == TArray<int16>( test_offsets, test_count ) );
+
+    TArray<uint8> empty;
+    vertices.Reset();
+    offsets.Reset();
+    TestTrue( TEXT("Empty packet decodes"), deformation_codec::decode( empty, vertices, offsets ) );
+    TestEqual( TEXT("Empty packet holds nothing"), vertices.Num(), 0 );
+    return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST( FDeformationCodecBudgetTest, "Project.Geometry.DeformationCodec.Budget", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter )
+bool FDeformationCodecBudgetTest::RunTest( const FString &Parameters )
+{
+    //one vertex needs at most 3 + 1 + 3 bytes, so 8 bytes always make progress and cut most runs short
+    const int32 budget = 8;
+    TArray<int32> vertices;
+    TArray<int16> offsets;
+    int32 packets = 0;
+    for( int32 done = 0; done < test_count; ++packets )
+    {
+        TArray<uint8> packet;
+        const int32 sent = deformation_codec::encode( test_vertices + done, test_offsets + done, test_count - done, budget, packet );
+        if( !TestTrue( TEXT("Every packet makes progress"), sent > 0 ) )
+        {
+            return false;
+        }
+        TestTrue( TEXT("Packet stays within the budget"), packet.Num() <= budget );
+        TestTrue( TEXT("Packet decodes"), deformation_codec::decode( packet, vertices, offsets ) );
+        done += sent;
+    }
+    TestTrue( TEXT("Split over several packets"), packets > 1 );
+    TestTrue( TEXT("Vertices survive the split"), vertices == TArray<int32>( test_vertices, test_count ) );
+    TestTrue( TEXT("Offsets survive the split"), offsets == TArray<int16>( test_offsets, test_count ) );
+
+    TArray<uint8> packet;
+    TestEqual( TEXT("Nothing is written when one vertex does not fit"), deformation_codec::encode( test_vertices, test_offsets, test_count, 2, packet ), 0 );
+    TestEqual( TEXT("A packet that holds nothing is empty"), packet.Num(), 0 );
+    return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST( FDeformationCodecMalformedTest, "Project.Geometry.DeformationCodec.Malformed", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter )
+bool FDeformationCodecMalformedTest::RunTest( const FString &Parameters )
+{
+    AddExpectedError( TEXT("Malformed deformation packet"), EAutomationExpectedErrorFlags::Contains, 3 );
+    TArray<int32> vertices;
+    TArray<int16> offsets;
+
+    const TArray<uint8> header_cut = { 0x80 };
+    TestFalse( TEXT("Run header cut short"), deformation_codec::decode( header_cut, vertices, offsets ) );
+    TestEqual( TEXT("Nothing decoded from a cut header"), vertices.Num(), 0 );
+
+    //gap 5, a run of 3, but only the first offset (+1) is there
+    const TArray<uint8> run_cut = { 5, 3, 2 };
+    TestFalse( TEXT("Run cut short"), deformation_codec::decode( run_cut, vertices, offsets ) );
+    TestEqual( TEXT("Vertices before the error are kept"), vertices.Num(), 1 );
+    TestTrue( TEXT("Kept vertex is the one encoded"), vertices.Num() == 1 && vertices[0] == 5 && offsets[0] == 1 );
+
+    const TArray<uint8> overlong = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01 };
+    vertices.Reset();
+    offsets.Reset();
+    TestFalse( TEXT("Varint longer than 5 bytes"), deformation_codec::decode( overlong, vertices, offsets ) );
+    return true;
+}
+
+#endif //WITH_DEV_AUTOMATION_TESTS
@@ -0,0 +1,74 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "Geometry/icostream.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST( FIcostreamMatchesIcosphereTest, "Project.Geometry.Icostream.MatchesIcosphere", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter )
+bool FIcostreamMatchesIcosphereTest::RunTest( const FString &Parameters )
+{
+    for( uint8 level = 0; level <= 5; ++level )
+    {
+        const uint32 vert_count = icostream::get_vert_count( level );
+        const uint32 tri_count = icostream::get_tri_count( level );
+        TArray<FVector> positions;
+        TArray<int32> emitted;
+        TArray<Triangle> triangles;
+        positions.SetNumZeroed( vert_count );
+        emitted.SetNumZeroed( vert_count );
+        bool in_range = true;
+        bool contiguous = true;
+
+        icosphere_callback_sink sink;
+        sink.on_vertices = [&]( const streamed_vertex* verts, int32 count )
+        {
+            for( int32 k = 0; k < count; ++k )
+            {
+                if( verts[k].index >= vert_count )
+                {
+                    in_range = false;
+                    continue;
+                }
+                positions[verts[k].index] = verts[k].position;
+                ++emitted[verts[k].index];
+            }
+        };
+        sink.on_triangles = [&]( uint32 first, const Triangle* tris, int32 count )
+        {
+            contiguous &= first == (uint32)triangles.Num();
+            triangles.Append( tris, count );
+        };
+        icostream( level ).run( sink );
+
+        const FString label = FString::Printf( TEXT("level %d"), level );
+        TestTrue( label + TEXT(": vertex indices are in range"), in_range );
+        TestTrue( label + TEXT(": every vertex is emitted exactly once"), !emitted.ContainsByPredicate( []( int32 times ){ return times != 1; } ) );
+        TestTrue( label + TEXT(": triangles arrive contiguously"), contiguous );
+        if( !TestEqual( label + TEXT(": triangle count"), (uint32)triangles.Num(), tri_count ) || !in_range )
+        {
+            continue;
+        }
+
+        //indices differ between the two, the positions at each corner must not
+        icosphere sphere( level );
+        const TArray<FVector> &vertices = sphere.get_vertices();
+        const TArray<Triangle> &expected = sphere.get_triangles();
+        int32 mismatches = 0;
+        for( uint32 t = 0; t < tri_count; ++t )
+        {
+            for( int32 c = 0; c < 3; ++c )
+            {
+                const uint32 index = triangles[t].vert[c];
+                if( index >= vert_count || positions[index] != vertices[expected[t].vert[c]] )
+                {
+                    ++mismatches;
+                }
+            }
+        }
+        TestEqual( label + TEXT(": corners bit-identical to icosphere"), mismatches, 0 );
+    }
+    return true;
+}
+
+#endif //WITH_DEV_AUTOMATION_TESTS
@@ -0,0 +1,140 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "Geometry/spherebvh.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+//distances of the nearest hit may come from different triangles when a ray crosses an edge
+static const float distance_tolerance = 1e-4f;
+
+//Moller-Trumbore against every triangle, both sides, nearest hit within max_distance
+static bool brute_trace( const TArray<FVector> &vertices, const TArray<int> &triangles, const sphere_ray &ray, sphere_hit &hit )
+{
+    hit = sphere_hit();
+    float limit = ray.max_distance;
+    for( int32 t = 0; t < triangles.Num() / 3; ++t )
+    {
+        const FVector &a = vertices[triangles[3 * t]];
+        FVector edge1 = vertices[triangles[3 * t + 1]] - a;
+        FVector edge2 = vertices[triangles[3 * t + 2]] - a;
+        FVector p = FVector::CrossProduct( ray.direction, edge2 );
+        float determinant = FVector::DotProduct( edge1, p );
+        if( determinant == 0.f )
+        {
+            continue;
+        }
+        float inverse = 1.f / determinant;
+        FVector s = ray.origin - a;
+        float u = FVector::DotProduct( s, p ) * inverse;
+        FVector q = FVector::CrossProduct( s, edge1 );
+        float v = FVector::DotProduct( ray.direction, q ) * inverse;
+        float distance = FVector::DotProduct( edge2, q ) * inverse;
+        if( u < 0.f || u > 1.f || v < 0.f || u + v > 1.f || distance < 0.f || distance > limit )
+        {
+            continue;
+        }
+        hit.triangle = t;
+        hit.distance = distance;
+        limit = distance;
+    }
+    return hit.is_hit();
+}
+
+//rays from outside aimed at the sphere around `target`, and rays from near the centre in every direction
+static TArray<sphere_ray> make_rays( FRandomStream &random, const FVector &target, float spread, int32 count )
+{
+    TArray<sphere_ray> rays;
+    for( int32 r = 0; r < count; ++r )
+    {
+        sphere_ray ray;
+        if( r % 4 == 3 )
+        {
+            ray.origin = random.VRand() * 0.3f;
+            ray.direction = random.VRand();
+        }
+        else
+        {
+            ray.origin = random.VRand() * 3.f;
+            FVector aim = target + random.VRand() * random.FRandRange( 0.f, spread );
+            ray.direction = (aim - ray.origin).GetSafeNormal();
+        }
+        //some rays stop short of the sphere, or inside it
+        ray.max_distance = r % 5 == 0 ? random.FRandRange( 1.f, 3.f ) : 10.f;
+        rays.Add( ray );
+    }
+    return rays;
+}
+
+//returns the number of rays where the tree and the brute force disagree, counts the hits
+static int32 compare_traces( const sphere_bvh &bvh, const TArray<FVector> &vertices, const TArray<int> &triangles, const TArray<sphere_ray> &rays, int32 &hits )
+{
+    int32 mismatches = 0;
+    for( const sphere_ray &ray : rays )
+    {
+        sphere_hit expected;
+        sphere_hit found;
+        const bool hit = brute_trace( vertices, triangles, ray, expected );
+        if( bvh.trace( ray, found ) != hit || (hit && FMath::Abs( found.distance - expected.distance ) > distance_tolerance) )
+        {
+            ++mismatches;
+        }
+        hits += hit ? 1 : 0;
+    }
+    return mismatches;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST( FSphereBVHTraceTest, "Project.Geometry.SphereBVH.Trace", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter )
+bool FSphereBVHTraceTest::RunTest( const FString &Parameters )
+{
+    const int32 ray_count = 2000;
+    icosphere sphere( 4 );
+    TArray<int> triangles;
+    triangles.Append( sphere.get_triangles_raw(), sphere.get_index_count() );
+    FRandomStream random( 7 );
+
+    for( int32 deformed = 0; deformed < 2; ++deformed )
+    {
+        const FString label = deformed ? TEXT("deformed") : TEXT("unit");
+        TArray<FVector> vertices = sphere.get_vertices();
+        if( deformed )
+        {
+            for( FVector &vertex : vertices )
+            {
+                vertex *= 1.f + 0.2f * FMath::Sin( 5.f * vertex.X ) * FMath::Cos( 3.f * vertex.Z );
+            }
+        }
+        sphere_bvh bvh;
+        if( !TestTrue( label + TEXT(": builds"), bvh.build( vertices, triangles ) ) )
+        {
+            return false;
+        }
+        int32 hits = 0;
+        TestEqual( label + TEXT(": trace matches brute force"), compare_traces( bvh, vertices, triangles, make_rays( random, FVector::ZeroVector, 1.2f, ray_count ), hits ), 0 );
+        TestTrue( label + TEXT(": most rays hit"), hits > ray_count / 2 );
+
+        //a bump above the old shell, then a dent below it, aimed at from outside and from within
+        const FVector centre = vertices[0].GetSafeNormal();
+        for( float height : { 0.3f, -0.5f } )
+        {
+            TArray<int32> changed;
+            for( int32 v = 0; v < vertices.Num(); ++v )
+            {
+                const FVector direction = vertices[v].GetSafeNormal();
+                if( FVector::DotProduct( direction, centre ) > 0.95f )
+                {
+                    vertices[v] = direction * (vertices[v].Size() + height);
+                    changed.Add( v );
+                }
+            }
+            bvh.refit( vertices, changed );
+            const FString edit = label + (height > 0.f ? TEXT(" bump") : TEXT(" dent"));
+            hits = 0;
+            TestEqual( edit + TEXT(": trace matches brute force after refit"), compare_traces( bvh, vertices, triangles, make_rays( random, centre, 0.4f, ray_count ), hits ), 0 );
+            TestTrue( edit + TEXT(": most rays hit"), hits > ray_count / 2 );
+        }
+    }
+    return true;
+}
+
+#endif //WITH_DEV_AUTOMATION_TESTS
@@ -2,6 +2,28 @@
 
 #include "projectGameModeBase.h"
 
+#include "Geometry/spherebatch.h"
+#include "Geometry/spherequery.h"
+#include "Geometry/displacement.h"
+#include "Geometry/icostream.h"
+#include "Misc/Paths.h"
 
 
+//console commands leave missing arguments zeroed, so zero means the default
+void AprojectGameModeBase::BenchmarkSphereBatch(int32 Count){
+    sphere_batch::benchmark(Count > 0 ? Count : 100);
+}
 
+void AprojectGameModeBase::BenchmarkVertexQuery(int32 Queries){
+    sphere_query::benchmark(Queries > 0 ? Queries : 1000);
+}
+
+void AprojectGameModeBase::BenchmarkDisplacement(){
+    displacement::benchmark();
+}
+
+void AprojectGameModeBase::BakeIcosphere(int32 Subdivisions){
+    const uint8 subdivisions = (uint8)FMath::Clamp(Subdivisions > 0 ? Subdivisions : 11, 0, (int32)icostream::max_subdivisions);
+    icosphere_file_sink sink(FPaths::Combine(FPaths::ProjectSavedDir(), FString::Printf(TEXT("icosphere_%d.bin"), subdivisions)));
+    icostream(subdivisions).run(sink);
+}
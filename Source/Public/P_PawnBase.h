@@ -6,9 +6,17 @@
 #include "GameFramework/Pawn.h"
 #include "AP_PawnBase.generated.h"
 
-class UProceduralMeshComponent;
+class UStagedMeshComponent;
 class UPawnMovementComponent;
 class USphereComponent;
+struct sphere_result;
+class sphere_bvh;
+class sphere_query;
+struct sphere_ray;
+struct sphere_hit;
+class height_source;
+class displacement;
+struct FProcMeshSection;
 
 UCLASS(BlueprintType, Blueprintable)
 class PROJECT_API AP_PawnBase : public APawn
@@ -21,6 +29,20 @@ private:
     TArray<FVector2D> m_uvmapping;
     float m_radius = 0.0;
     float m_masterVertex;
+    TSharedPtr<sphere_bvh> m_raytree; //built on the first trace after the mesh changes
+    TSharedPtr<sphere_query> m_vertexquery; //connectivity only, survives everything but a new vertex count
+    TSharedPtr<displacement> m_displacement; //keeps the vertex to triangle table for displacements and normal updates
+    TArray<int32> m_dirty; //edited vertices the clients have not been sent yet
+    TBitArray<> m_dirtyflags;
+    TMap<int32, int16> m_craters; //quantized offset of every edited vertex from the terrain under it, what packets carry
+    TMap<int32, int16> m_pendingCraters; //offsets that reached a client before its sphere, applied by MakeMesh
+    bool m_resyncDeformation = false; //a client's craters were reset, it asks for all of them once the mesh exists
+    float m_netbudget = 0.f; //bytes deformation packets may still use, refilled at DeformationBandwidth
+    float m_netclock = 0.f; //time since the last deformation packet
+    float m_netstatclock = 0.f;
+    int32 m_netbytes = 0; //sent since m_netstatclock was reset
+    bool m_collisionstale = false; //edited vertices the mesh's collision does not have yet
+    float m_collisionclock = 0.f; //time since collision was last re-cooked
 
 public:
     static FName CollisionComponentName;
@@ -29,7 +51,7 @@ public:
 
 private:
     UPROPERTY(Category = PPawn, VisibleAnywhere, BlueprintReadOnly, meta = (AllowPrivateAccess = "true"))
-	UProceduralMeshComponent* MeshComponent;
+	UStagedMeshComponent* MeshComponent;
     UPROPERTY(Category = PPawn, VisibleAnywhere, BlueprintReadOnly, meta = (AllowPrivateAccess = "true"))
 	UPawnMovementComponent* MovementComponent;
     UPROPERTY(Category = PPawn, VisibleAnywhere, BlueprintReadOnly, meta = (AllowPrivateAccess = "true"))
@@ -37,8 +59,39 @@ private:
 
     bool hasSphereData();
     bool hasRadius();
+    const sphere_bvh* getRayTree();
+    float baseRadius() const;
+    int16 quantizeOffset(float offset) const;
+    float dequantizeOffset(int16 offset) const;
+    void markDirty(int32 vertex);
+    void resetDeformation();
+    float terrainHeight(int32 vertex) const;
+    void setCrater(int32 vertex, int16 offset);
+    void queueAllCraters();
+    displacement& getDisplacement();
+    void updateVertices(const TArray<int32> &changed);
+    void sendDeformation(float DeltaTime);
 
 protected:
+    // Bytes per second the deformation replication may use, edits beyond that wait for later net updates
+    UPROPERTY(Category = PPawn, EditAnywhere, BlueprintReadWrite)
+    int32 DeformationBandwidth = 8192;
+
+    // Replicated offsets are whole multiples of radius * DeformationPrecision
+    UPROPERTY(Category = PPawn, EditAnywhere, BlueprintReadWrite)
+    float DeformationPrecision = 1.f / 4096.f;
+
+    // Seconds between collision re-cooks while the mesh is being edited, edits in between are cooked together
+    UPROPERTY(Category = PPawn, EditAnywhere, BlueprintReadWrite)
+    float CollisionRefreshInterval = 0.5f;
+
+    UFUNCTION(NetMulticast, Reliable)
+    void MulticastDeformation(const TArray<uint8> &Packet);
+
+    // Sent by an owning client whose craters were reset, the server queues every crater it has again
+    UFUNCTION(Server, Reliable)
+    void ServerResendDeformation();
+
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 
@@ -60,6 +113,58 @@ public:
     // Sets default values for this pawn's properties
     AP_PawnBase();
 
+    // Generates spheres for many pawns at once on worker threads, each pawn gets its mesh as soon as its sphere is done
+    UFUNCTION(BlueprintCallable, Category = "PPawn")
+    static void ConstructSpheres(const TArray<AP_PawnBase*> &Pawns, uint8 Subdivisions = 9, float Radius = 1.f, int32 Seed = 0, float Deformation = 0.f);
+
+    // Takes the buffers of a finished sphere job and makes the mesh from them
+    void SetSphereData(sphere_result &result);
+
+    // Traces against the mesh as it is deformed, Start and End are in world space. Distance is in world units
+    UFUNCTION(BlueprintCallable, Category = "PPawn")
+    bool TraceSphere(FVector Start, FVector End, int32 &Triangle, FVector &Barycentric, float &Distance);
+
+    // Same as TraceSphere for many rays at once, spread over worker threads. Rays and hits are in world space
+    void TraceSphereRays(const TArray<sphere_ray> &rays, TArray<sphere_hit> &hits);
+
+    // Vertices at most Hops edges away from Vertex, Vertex included
+    UFUNCTION(BlueprintCallable, Category = "PPawn")
+    void GetVerticesInRing(int32 Vertex, int32 Hops, TArray<int32> &Vertices);
+
+    // Vertices within Distance of WorldPoint, measured along the sphere's surface
+    UFUNCTION(BlueprintCallable, Category = "PPawn")
+    void GetVerticesWithin(FVector WorldPoint, float Distance, TArray<int32> &Vertices);
+
+    // Shared query engine for batched ring and distance queries, null until the sphere exists
+    sphere_query* GetVertexQuery();
+
+    // Server side, the pawn is being sent to a client that does not have it yet (late join, or relevant again)
+    virtual void OnSerializeNewActor(class FOutBunch &OutBunch) override;
+
+    // Server only. Digs a bowl of CraterRadius (along the surface) and Depth at WorldPoint, clients get it through replication.
+    // The mesh's collision follows within CollisionRefreshInterval, cooked in the background.
+    // Clients that join late get every crater when the pawn reaches them, packets that arrive before a client's sphere
+    // wait for its MakeMesh, and an owning client that rebuilds its sphere asks for the craters again
+    UFUNCTION(BlueprintCallable, Category = "PPawn")
+    void AddCrater(FVector WorldPoint, float CraterRadius, float Depth);
+
+    // Sets every vertex to the base radius plus the map's height at its longitude and latitude (equirectangular),
+    // Heights is Width x Height row major. Scale is in sphere radii, so the same map looks the same on any size of sphere
+    UFUNCTION(BlueprintCallable, Category = "PPawn")
+    void DisplaceByHeightmap(const TArray<float> &Heights, int32 Width, int32 Height, float Scale);
+
+    // Sets every vertex to the base radius plus fractal noise sampled at its direction, Scale is in sphere radii
+    UFUNCTION(BlueprintCallable, Category = "PPawn")
+    void DisplaceByNoise(int32 Seed, int32 Octaves = 6, float Frequency = 2.f, float Scale = 0.05f);
+
+    // Displaces from any height source and rebuilds smooth normals. Not replicated, every machine runs the same call.
+    // Craters stay on top of the new terrain, so a crater packet may arrive before or after a client's Displace
+    void Displace(const height_source &source, float Scale);
+
+    // Refills the mesh on a worker thread, it is presented on a later Tick. For continuous animation, the pawn's own
+    // vertex arrays (and so traces, queries and replication) keep describing the mesh as it was before staging
+    bool StageMesh(TFunction<void(FProcMeshSection &section)> Fill);
+
     // Called every frame
     virtual void Tick(float DeltaTime) override;
 
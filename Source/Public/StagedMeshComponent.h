@@ -0,0 +1,91 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Components/MeshComponent.h"
+#include "Interfaces/Interface_CollisionDataProvider.h"
+#include "ProceduralMeshComponent.h"
+#include "StagedMeshComponent.generated.h"
+
+class mesh_staging;
+class UBodySetup;
+
+/**
+ * Single section mesh with its own scene proxy, for meshes whose topology is fixed but whose vertices keep moving.
+ * CreateMeshSection builds a new proxy like any mesh component. After that, vertex changes only rewrite positions and
+ * tangents in the proxy's existing GPU buffers on the render thread. Indices and uvs are left alone, and the proxy is
+ * not recreated.
+ *   Stage/PresentStaged - workers fill whole back buffers, presenting hands the newest one to the render thread
+ *   UpdateVertices      - sparse edits, only the listed vertices are copied. Uploads cover them in at most 32 runs of
+ *                         nearby indices, so a few unchanged vertices between close edits go along
+ * Collision is cooked with CreateMeshSection. Neither path touches it, UpdateCollision re-cooks it from the current
+ * vertices on a worker while the old collision stays in use.
+ */
+UCLASS(ClassGroup = Rendering, meta = (BlueprintSpawnableComponent))
+class PROJECT_API UStagedMeshComponent : public UMeshComponent, public IInterface_CollisionDataProvider
+{
+	GENERATED_BODY()
+public:
+    using fill_function = TFunction<void( FProcMeshSection &section )>;
+    using shared_section = TSharedPtr<FProcMeshSection, ESPMode::ThreadSafe>;
+
+private:
+    shared_section m_section; //replaced as a whole, never edited while a render command may still read it
+    TSharedPtr<mesh_staging, ESPMode::ThreadSafe> m_staging;
+
+    UPROPERTY(Transient)
+    UBodySetup* MeshBodySetup;
+
+    // being cooked on a worker, replaces MeshBodySetup when done unless CreateMeshSection came in between
+    UPROPERTY(Transient)
+    UBodySetup* CookingBodySetup;
+
+    bool m_collisionstale = false; //UpdateCollision was called while a cook was running
+
+    UBodySetup* createBodySetup();
+    void updateCollision();
+    void finishCollision(bool bSuccess, UBodySetup* body);
+
+public:
+    // Back buffers besides the live section, two lets one be filled while another waits to be presented
+    UPROPERTY(Category = Staging, EditAnywhere, BlueprintReadWrite)
+    int32 StagingBuffers = 2;
+
+    // Game thread. Replaces the mesh and its scene proxy, and cooks collision when asked to
+    void CreateMeshSection(const TArray<FVector> &Vertices, const TArray<int32> &Triangles, const TArray<FVector> &Normals, const TArray<FVector2D> &UV0, bool bCreateCollision);
+
+    // Game thread. Copies only the Changed vertices, reading them from the full Vertices and Normals arrays, and uploads
+    // the runs of the buffer around them
+    void UpdateVertices(const TArray<int32> &Changed, const TArray<FVector> &Vertices, const TArray<FVector> &Normals);
+
+    // Game thread. Cooks collision from the section as it is now, asynchronously. Calls made while a cook is running
+    // are folded into one more cook after it. Does nothing if the section was created without collision
+    void UpdateCollision();
+
+    // Game thread. Runs fill on a worker against a back buffer holding the section as of an earlier present.
+    // Fill has to write every vertex it animates. Returns false if every buffer is busy
+    bool Stage(fill_function fill);
+
+    // Game thread. Hands the newest filled buffer to the render thread as the section, returns false if there was none
+    bool PresentStaged();
+
+    //~ Begin UPrimitiveComponent Interface
+    virtual FPrimitiveSceneProxy* CreateSceneProxy() override;
+    virtual UBodySetup* GetBodySetup() override;
+    //~ End UPrimitiveComponent Interface
+
+    //~ Begin UMeshComponent Interface
+    virtual int32 GetNumMaterials() const override { return 1; }
+    //~ End UMeshComponent Interface
+
+    //~ Begin USceneComponent Interface
+    virtual FBoxSphereBounds CalcBounds(const FTransform &LocalToWorld) const override;
+    //~ End USceneComponent Interface
+
+    //~ Begin IInterface_CollisionDataProvider Interface
+    virtual bool GetPhysicsTriMeshData(struct FTriMeshCollisionData* CollisionData, bool InUseAllTriData) override;
+    virtual bool ContainsPhysicsTriMeshData(bool InUseAllTriData) const override;
+    virtual bool WantsNegXTriMesh() override { return false; }
+    //~ End IInterface_CollisionDataProvider Interface
+};
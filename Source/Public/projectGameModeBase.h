@@ -7,14 +7,27 @@
 #include "projectGameModeBase.generated.h"
 
 /**
- * 
+ * Benchmarks of the geometry code, and an offline icosphere bake, are exposed here as console commands (standalone or server)
  */
 UCLASS()
 class PROJECT_API AprojectGameModeBase : public AGameModeBase
 {
 	GENERATED_BODY()
-	
-	
-	
+public:
+    // BenchmarkSphereBatch [count], wall time of batched sphere jobs against building them one by one
+    UFUNCTION(Exec)
+    void BenchmarkSphereBatch(int32 Count);
+
+    // BenchmarkVertexQuery [queries], latency of ring and distance queries on levels 6 to 9
+    UFUNCTION(Exec)
+    void BenchmarkVertexQuery(int32 Queries);
+
+    // BenchmarkDisplacement, vertices per second of an fBm displacement with smooth normals on levels 7 to 9
+    UFUNCTION(Exec)
+    void BenchmarkDisplacement();
+
+    // BakeIcosphere [subdivisions], streams a sphere too large to hold in memory to Saved/icosphere_<subdivisions>.bin
+    UFUNCTION(Exec)
+    void BakeIcosphere(int32 Subdivisions);
 	
 };
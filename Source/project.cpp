@@ -11,6 +11,7 @@ DEFINE_LOG_CATEGORY(Init);
 //Logging for some system
 DEFINE_LOG_CATEGORY(Geometry);
 DEFINE_LOG_CATEGORY(Materials);
+DEFINE_LOG_CATEGORY(Replication);
  
 //Logging for Critical Errors that must always be addressed
 DEFINE_LOG_CATEGORY(CriticalErrors);
\ No newline at end of file
@@ -21,6 +21,7 @@ DECLARE_LOG_CATEGORY_EXTERN(Init, Display, All);
 //Logging for a that troublesome system
 DECLARE_LOG_CATEGORY_EXTERN(Geometry, Display, Log);
 DECLARE_LOG_CATEGORY_EXTERN(Materials, Display, All);
+DECLARE_LOG_CATEGORY_EXTERN(Replication, Display, Log);
  
 //Logging for Critical Errors that must always be addressed
 DECLARE_LOG_CATEGORY_EXTERN(CriticalErrors, Error, All);